@@ -20,16 +20,23 @@
 #include "proto_const.h"
 #include "util.h"
 #include "configuration.h"
+#include "image.h"
+#include "line.h"
+#include "watchdog.h"
+#include "upload.h"
+#include "status.h"
+#include "shm.h"
+#include "history.h"
+#include "metrics.h"
 
 #include <arpa/inet.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 enum action {
 	AC_ENTER,
@@ -38,12 +45,12 @@ enum action {
 };
 
 struct action_def {
-	const struct transition *(*hook)(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size);
+	const struct transition *(*hook)(struct line *line, struct extra_state *state, const void *packet, size_t packet_size);
 	struct transition value;
 };
 
-static const struct transition *hook_ignore(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
+static const struct transition *hook_ignore(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)line;
 	(void)state;
 	(void)packet;
 	(void)packet_size;
@@ -58,8 +65,11 @@ struct node_def {
 };
 
 struct extra_state {
-	int image_fd;
+	// The image being offered or sent (held, so it stays the same even if the file is replaced meanwhile)
+	struct image *image;
 	uint32_t image_offset;
+	// Size of the last image part sent
+	uint32_t part_size;
 	size_t conn_index;
 };
 
@@ -86,15 +96,16 @@ struct param_answer {
 	uint8_t data[];
 } __attribute__((packed));
 
-static const struct transition *check_presence_answer(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
+static const struct transition *check_presence_answer(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
 	(void)state;
 	const struct param_answer *answer = packet;
 	if (packet_size < sizeof *answer)
 		return NULL; // Message too short
 	if (answer->cmd != CMD_ANSWER_PARAM || ntohs(answer->seq) != 1 || ntohl(answer->type) != PARAM_PM)
 		return NULL;
-	msg("Modem seems to be present\n");
+	line_msg(line, "Modem seems to be present\n");
+	line->dead_probes = 0;
+	// Offer the image right away. A modem that runs firmware already ignores it, so it doesn't wait for an upload slot.
 	static struct transition result = {
 		.new_state = AS_ASKED_WANT_IMAGE,
 		.state_change = true
@@ -107,8 +118,28 @@ struct img_ack {
 	uint32_t status;
 } __attribute__((packed));
 
-static const struct transition *check_want_image_answer(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
+/*
+ * The modem wants the image, but all the upload slots are taken. Wait (without
+ * a timeout) until the upload scheduler wakes us, then offer the image again.
+ */
+static const struct transition *upload_wait(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)state;
+	(void)packet;
+	(void)packet_size;
+	if (upload_admit(&line->upload)) {
+		static struct transition go = {
+			.new_state = AS_ASKED_WANT_IMAGE,
+			.state_change = true
+		};
+		return &go;
+	}
+	static struct transition wait = {
+		.status_name = "waiting for upload"
+	};
+	return &wait;
+}
+
+static const struct transition *check_want_image_answer(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
 	(void)state;
 	const struct img_ack *ack = packet;
 	if (packet_size < sizeof *ack) // Too short to be the right kind of packet
@@ -118,17 +149,24 @@ static const struct transition *check_want_image_answer(const char *ifname, stru
 	if (ntohl(ack->status) != IMG_PROCEED) {
 		// There was an error. But it shouldn't refuse to upload an image (it may ignore the offer), try reseting it and start again once more.
 		return &reset_transition;
+	} else if (!upload_admit(&line->upload)) {
+		static struct transition wait = {
+			.new_state = AS_UPLOAD_WAIT,
+			.state_change = true
+		};
+		return &wait;
 	} else {
-		struct extra_state *new_state = malloc(sizeof *new_state);
-		if ((new_state->image_fd = open(image_path, O_RDONLY)) == -1)
-			die("Couldn't open %s: %s\n", image_path, strerror(errno));
-		new_state->image_offset = 0;
-		msg("Sending firmware");
+		assert(state && state->image);
+		state->image_offset = 0;
+		line->chunk_size = 0; // Decide the part size anew
+		upload_start(&line->upload, line->now);
+		metric_inc(&line->metrics, MC_UPLOADS_STARTED);
+		line_msg(line, "Sending firmware\n");
 		static struct transition result = {
 			.new_state = AS_SEND_FIRMWARE,
 			.state_change = true
 		};
-		result.extra_state = new_state;
+		result.extra_state = state;
 		return &result;
 	}
 }
@@ -140,18 +178,51 @@ struct file_offer {
 	uint8_t ftype;
 } __attribute__((packed));
 
-static const struct transition *prepare_image_offer(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
-	(void)state;
+// The image of the firmware, if it can be uploaded. The problems are logged once for all the lines.
+static struct image *usable_image(const struct firmware *firmware) {
+	const char *problem;
+	struct image *image = image_get(firmware->image_path, &problem);
+	if (image)
+		problem = image_check(image, firmware->crc_set, firmware->crc);
+	if (image_report(firmware->image_path, problem))
+		error_msg("Firmware image %s: %s, not uploading it\n", firmware->image_path, problem);
+	return problem ? NULL : image;
+}
+
+static const struct transition *prepare_image_offer(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
 	(void)packet;
 	(void)packet_size;
+	const struct firmware *firmware = iface_firmware(line->ifname);
+	assert(firmware);
+	struct image *image = usable_image(firmware);
+	if (!image) {
+		static struct transition invalid = {
+			.new_state = AS_INVALID_IMAGE,
+			.state_change = true
+		};
+		return &invalid;
+	}
+	// Whatever the modem ends up running comes from this offer
+	image_ref(image);
+	image_unref(line->image);
+	line->image = image;
+	free(line->image_version);
+	line->image_version = strdup(firmware->version);
+	if (!state) {
+		state = malloc(sizeof *state);
+		*state = (struct extra_state) {
+			.image = NULL
+		};
+	}
+	if (state->image != image) {
+		image_ref(image);
+		image_unref(state->image);
+		state->image = image;
+	}
 	static struct file_offer offer = {
 		.cmd = CMD_OFFER_IMAGE
 	};
-	struct stat st;
-	if (stat(image_path, &st) == -1)
-		die("Couldn't stat %s: %s\n", image_path, strerror(errno));
-	offer.fsize = htonl(st.st_size);
+	offer.fsize = htonl(image->size);
 	static struct transition result = {
 		.timeout = 50,
 		.timeout_mult = 2,
@@ -162,6 +233,7 @@ static const struct transition *prepare_image_offer(const char *ifname, struct e
 		.packet_size = sizeof offer,
 		.packet_send = true
 	};
+	result.extra_state = state;
 	return &result;
 }
 
@@ -169,49 +241,113 @@ struct image_part {
 	uint8_t cmd;
 	uint32_t offset;
 	uint32_t size;
-	uint8_t data[MAX_DATA_PAYLOAD];
+	uint8_t data[MAX_JUMBO_PAYLOAD];
 } __attribute__((packed));
 
-static const struct transition *send_image_part(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
+// The largest image part that fits into the MTU of the line (divisible by 4)
+static uint32_t chunk_limit(const struct line *line) {
+	int limit = (line->mtu - IMAGE_PART_HEADER) & ~3;
+	if (limit > MAX_JUMBO_PAYLOAD)
+		limit = MAX_JUMBO_PAYLOAD;
+	if (limit < MAX_DATA_PAYLOAD)
+		limit = MAX_DATA_PAYLOAD;
+	return limit;
+}
+
+/*
+ * Decide the size of the next image part. We use the largest size known to
+ * work and, if allowed, try a larger one (twice the size, up to what fits
+ * into the MTU) as long as the modem keeps accepting them.
+ */
+static void chunk_next(struct line *line) {
+	if (!line->chunk_good)
+		line->chunk_good = MAX_DATA_PAYLOAD;
+	line->chunk_size = line->chunk_good;
+	if (!chunk_probe || line->chunk_probe_failed)
+		return;
+	uint32_t limit = chunk_limit(line);
+	if (line->chunk_good < limit) {
+		line->chunk_size = line->chunk_good * 2;
+		if (line->chunk_size > limit)
+			line->chunk_size = limit;
+		dbg("Probing image part size %u\n", (unsigned)line->chunk_size);
+	}
+}
+
+// The larger image part didn't work. Never try it again on this line and use the safe size.
+static void chunk_fallback(struct line *line) {
+	line_msg(line, "Image parts of size %u don't work, falling back to %u\n", (unsigned)line->chunk_size, (unsigned)MAX_DATA_PAYLOAD);
+	line->chunk_good = line->chunk_size = MAX_DATA_PAYLOAD;
+	line->chunk_probe_failed = true;
+}
+
+static const struct transition *send_image_part(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
 	(void)packet;
 	(void)packet_size;
-	assert(state);
-	assert(state->image_fd != -1);
-	if (lseek(state->image_fd, state->image_offset, SEEK_SET) == (off_t)-1)
-		die("Couldn't seek in firmware image %s to location %zd: %s\n", image_path, (ssize_t)state->image_offset, strerror(errno));
+	assert(state && state->image);
 	static struct image_part part = {
 		.cmd = CMD_IMG_DATA
 	};
-	ssize_t amount = read(state->image_fd, part.data, sizeof part.data);
-	if (amount == -1)
-		die("Couldn't read data from firmware image %s at location %zd: %s\n", image_path, (ssize_t)state->image_offset, strerror(errno));
+	if (!line->chunk_size)
+		chunk_next(line);
+	const struct image *image = state->image;
+	uint32_t amount = 0;
+	if (state->image_offset < image->size)
+		amount = image->size - state->image_offset < line->chunk_size ? image->size - state->image_offset : line->chunk_size;
+	memcpy(part.data, image->data + state->image_offset, amount);
 	part.offset = htonl(state->image_offset);
 	part.size = htonl(amount);
 	static struct transition result = {
 		.timeout = 50,
 		.timeout_mult = 2,
-		.retries = 2,
 		.timeout_set = true,
 		.packet = (uint8_t *)&part,
 		.packet_send = true
 	};
+	// When probing a larger size, the first timeout means it doesn't work. Don't retry, fall back.
+	result.retries = line->chunk_size > line->chunk_good ? 0 : 2;
 	// Don't send the empty data at the end
-	result.packet_size = sizeof part + amount - MAX_DATA_PAYLOAD;
+	result.packet_size = sizeof part - sizeof part.data + amount;
+	state->part_size = amount;
+	upload_part_sent(&line->upload, line->now);
 	result.extra_state = state;
 	return &result;
 }
 
-static const struct transition *check_image_ack(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
+static const struct transition *check_image_ack(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
 	const struct img_ack *ack = packet;
 	if (packet_size < sizeof *ack) // Too short to be the right kind of packet
 		return NULL;
 	if (ack->cmd != CMD_IMG_ACK) // Wrong type of packet
 		return NULL;
 	uint32_t status = ntohl(ack->status);
+	/*
+	 * Only the ack of the outstanding part moves the upload. A duplicate or a
+	 * late one would send another part each, running several part streams at once.
+	 */
+	if (status <= IMG_MAX_ACK && status != state->image_offset + state->part_size)
+		return NULL;
+	upload_part_acked(&line->upload, line->now);
+	if (status == IMG_COMPLETE) {
+		upload_complete(&line->upload);
+		metric_inc(&line->metrics, MC_UPLOADS_COMPLETED);
+		uint64_t size = state->image_offset + state->part_size;
+		metric_add(&line->metrics, MC_UPLOAD_BYTES, state->part_size);
+		uint64_t duration = line->now - line->upload.started_at;
+		metric_observe(MH_UPLOAD_SPEED, size * 1000 / (duration ? duration : 1));
+	}
 	if (status <= IMG_MAX_ACK) {
-		// Acked a packet, move to the next one
+		metric_add(&line->metrics, MC_UPLOAD_BYTES, state->part_size);
+		/*
+		 * Acked a packet, move to the next one. Only a part of the probed size
+		 * tells if the size works (the short last one proves nothing). A size
+		 * that doesn't work gets no ack and falls back on the timeout.
+		 */
+		if (line->chunk_size > line->chunk_good && state->part_size == line->chunk_size) {
+			// The modem took the whole larger part, remember it works
+			line->chunk_good = line->chunk_size;
+			chunk_next(line);
+		}
 		state->image_offset = status;
 		static struct transition result = {
 			.new_state = AS_SEND_FIRMWARE,
@@ -230,6 +366,26 @@ static const struct transition *check_image_ack(const char *ifname, struct extra
 	}
 }
 
+static const struct transition *image_part_timeout(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)packet;
+	(void)packet_size;
+	if (line->chunk_size > MAX_DATA_PAYLOAD) {
+		// A stall with a larger image part. Send the same part again, with the safe size.
+		chunk_fallback(line);
+		static struct transition result = {
+			.new_state = AS_SEND_FIRMWARE,
+			.state_change = true
+		};
+		result.extra_state = state;
+		return &result;
+	}
+	static struct transition present = {
+		.new_state = AS_ASKED_PRESENT,
+		.state_change = true
+	};
+	return &present;
+}
+
 struct version {
 	uint8_t cmd;
 	uint16_t len;
@@ -239,15 +395,20 @@ struct version {
 	char dsp[20];
 } __attribute__((packed));
 
-static const struct transition *check_version(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
+static const struct transition *check_version(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
 	(void)state;
 	const struct version *version = packet;
 	if (packet_size < sizeof *version)
 		return NULL; // Too short a packet
 	if (version->cmd != CMD_ANSWER_PARAM || ntohl(version->param) != PARAM_VERSION)
 		return NULL; // Wrong packet
-	if (strcmp(version->fw, fw_version) != 0) {
+	// Check against what was offered (that is always done before asking), no need to look up the configuration
+	const char *expected = line->image_version;
+	if (!expected) {
+		const struct firmware *firmware = iface_firmware(line->ifname);
+		expected = firmware ? firmware->version : NULL;
+	}
+	if (!expected || strcmp(version->fw, expected) != 0) {
 		// Wrong version if image, reset it and load a new one
 		return &reset_transition;
 	} else {
@@ -267,8 +428,8 @@ struct param_ack {
 	uint8_t error;
 } __attribute__((packed));
 
-static const struct transition *check_ack(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size, uint16_t seq, enum autom_state new_state) {
-	(void)ifname;
+static const struct transition *check_ack(struct line *line, struct extra_state *state, const void *packet, size_t packet_size, uint16_t seq, enum autom_state new_state) {
+	(void)line;
 	const struct param_ack *ack = packet;
 	if (packet_size < sizeof *ack)
 		return NULL;
@@ -287,16 +448,16 @@ static const struct transition *check_ack(const char *ifname, struct extra_state
 	}
 }
 
-static const struct transition *check_link_ack(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	return check_ack(ifname, state, packet, packet_size, 3, AS_FIRST_START);
+static const struct transition *check_link_ack(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	return check_ack(line, state, packet, packet_size, 3, AS_FIRST_START);
 }
 
-static const struct transition *check_mode_ack(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	return check_ack(ifname, state, packet, packet_size, 6, AS_SEND_CONFIG_CONN);
+static const struct transition *check_mode_ack(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	return check_ack(line, state, packet, packet_size, 6, AS_SEND_CONFIG_CONN);
 }
 
-static const struct transition *check_mode_all_ack(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	return check_ack(ifname, state, packet, packet_size, 7, AS_ALL_START);
+static const struct transition *check_mode_all_ack(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	return check_ack(line, state, packet, packet_size, 7, AS_ALL_START);
 }
 
 struct state {
@@ -350,37 +511,69 @@ static const char *const annexes[] = {
 	[1 << 7] = "M"
 };
 
-static const struct transition *check_state(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)ifname;
+// Check the packet is an answer to status query. If so, write it into the status file, feed the watchdog with it (unless verdict is NULL) and return it.
+static const struct state *parse_state(struct line *line, const void *packet, size_t packet_size, enum watchdog_verdict *verdict) {
 	const struct state *st = packet;
 	if (packet_size < sizeof *st)
 		return NULL;
 	if (st->cmd != CMD_ANSWER_PARAM || ntohs(st->seq) != 4 || ntohl(st->param) != PARAM_STATUS)
 		return NULL;
+	const struct line_report report = {
+		.state = st->state,
+		.standard = st->standard,
+		.annex = st->annex,
+		.power = st->power,
+		.dsmax = ntohl(st->dsmax),
+		.usmax = ntohl(st->usmax),
+		.dscur = ntohl(st->dscur),
+		.uscur = ntohl(st->uscur),
+		.dspower = ntohs(st->dspower),
+		.uspower = ntohs(st->uspower)
+	};
+	struct status *f = &line->status;
+	status_begin(f);
+	assert(report.state < sizeof states / sizeof *states);
+	status_printf(f, "<status>%s</status>\n", states[report.state]);
+	if (report.standard < sizeof standards / sizeof *standards)
+		status_printf(f, "<standard>%s</standard>\n", standards[report.standard]);
+	if (report.annex < sizeof annexes / sizeof *annexes)
+		status_printf(f, "<annex>%s</annex>\n", annexes[report.annex]);
+	status_printf(f, "<power-state>%hhu</power-state>\n", report.power);
+	status_printf(f, "<max-speed><down>%u</down><up>%u</up></max-speed>\n", (unsigned)report.dsmax, (unsigned)report.usmax);
+	status_printf(f, "<cur-speed><down>%u</down><up>%u</up></cur-speed>\n", (unsigned)report.dscur, (unsigned)report.uscur);
+	status_printf(f, "<power><down>%u</down><up>%u</up></power>\n", (unsigned)report.dspower, (unsigned)report.uspower);
+	status_commit(f);
+	shm_status(line->shm_slot, states[report.state], line->now);
+	shm_report(line->shm_slot, &report, line->now);
+	history_add(line->history, &report, line->now);
+	const struct watchdog_sample sample = {
+		.time = line->now,
+		.answered = true,
+		.state = report.state,
+		.power = report.power,
+		.dscur = report.dscur,
+		.uscur = report.uscur,
+		.dspower = report.dspower,
+		.uspower = report.uspower
+	};
+	if (verdict)
+		*verdict = watchdog_sample(&line->watchdog, &sample);
+	return st;
+}
+
+static const struct transition *check_state(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	// The start has its own time limit, the watchdog is not consulted until the line is running
+	const struct state *st = parse_state(line, packet, packet_size, NULL);
+	if (!st)
+		return NULL;
 	// If it is in up state, then everything is nice
-	const char *path = interface_status_path(ifname);
-	FILE *f = fopen(path, "w");
-	if (!f)
-		die("Couldn't write interface state file %s: %s\n", path, strerror(errno));
-	assert(st->state < sizeof states / sizeof *states);
-	fprintf(f, "<status>%s</status>\n", states[st->state]);
-	if (st->standard < sizeof standards / sizeof *standards)
-		fprintf(f, "<standard>%s</standard>\n", standards[st->standard]);
-	if (st->annex < sizeof annexes / sizeof *annexes)
-		fprintf(f, "<annex>%s</annex>\n", annexes[st->annex]);
-	fprintf(f, "<power-state>%hhu</power-state>\n", st->power);
-	fprintf(f, "<max-speed><down>%u</down><up>%u</up></max-speed>\n", ntohl(st->dsmax), ntohl(st->usmax));
-	fprintf(f, "<cur-speed><down>%u</down><up>%u</up></cur-speed>\n", ntohl(st->dscur), ntohl(st->uscur));
-	fprintf(f, "<power><down>%u</down><up>%u</up></power>\n", ntohs(st->dspower), ntohs(st->uspower));
-	if (fclose(f) == EOF)
-		die("Couldn't close interface state file %s: %s\n", path, strerror(errno));
 	if (st->state == STATE_OK) {
 		static struct transition result = {
 			.new_state = AS_WATCH,
 			.state_change = true
 		};
 		result.extra_state = state;
-		msg("Modem is running\n");
+		line_msg(line, "Modem is running\n");
 		return &result;
 	} else {
 		dbg("In state %hhu\n", st->state);
@@ -394,6 +587,63 @@ static const struct transition *check_state(const char *ifname, struct extra_sta
 	}
 }
 
+static const struct transition *watch_verdict(struct line *line, enum watchdog_verdict verdict) {
+	static struct transition back = {
+		.new_state = AS_WATCH,
+		.state_change = true
+	};
+	if (verdict != WD_RESET)
+		return &back;
+	line_msg(line, "%s, resetting\n", line->watchdog.reason);
+	return &reset_transition;
+}
+
+// An answer to the periodic status query. Let the watchdog decide.
+static const struct transition *check_watch_state(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)state;
+	enum watchdog_verdict verdict;
+	if (!parse_state(line, packet, packet_size, &verdict))
+		return NULL;
+	return watch_verdict(line, verdict);
+}
+
+// The modem didn't answer the periodic status query at all.
+static const struct transition *check_silence(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)state;
+	(void)packet;
+	(void)packet_size;
+	const struct watchdog_sample sample = {
+		.time = line->now
+	};
+	return watch_verdict(line, watchdog_sample(&line->watchdog, &sample));
+}
+
+// Sleep until the next check. Healthy lines are checked rarely, the others often.
+static const struct transition *watch_enter(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)state;
+	(void)packet;
+	(void)packet_size;
+	static struct transition reconfig = {
+		.new_state = AS_RECONFIG,
+		.state_change = true
+	};
+	if (line_conns_changed(line))
+		return &reconfig;
+	static struct transition result = {
+		.timeout_set = true
+	};
+	/*
+	 * Check on average once per the interval, but each line at a different
+	 * time. The slack lets the lines that are close to each other to be
+	 * handled in a single wakeup.
+	 */
+	int interval = watchdog_next(&line->watchdog);
+	result.timeout = interval * 3 / 4;
+	result.timeout_jitter = interval / 2;
+	result.timeout_slack = interval / 4;
+	return &result;
+}
+
 struct conn_params {
 	uint8_t command;
 	uint16_t len;
@@ -414,24 +664,49 @@ struct conn_params {
 	uint8_t vlan_flag;
 } __attribute__((packed));
 
-static const struct transition *send_conn(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
-	(void)packet;
-	(void)packet_size;
-	if (!state) {
-		state = malloc(sizeof *state);
-		*state = (struct extra_state) {
-			.image_fd = -1
-		};
-	}
-	const struct conn_mapping *conns = iface_conns(ifname);
+static bool conn_equal(const struct conn_mapping *a, const struct conn_mapping *b) {
+	if (a->active != b->active)
+		return false;
+	return !a->active || (a->vlan == b->vlan && a->vpi == b->vpi && a->vci == b->vci);
+}
+
+bool line_firmware_changed(const struct line *line) {
+	if (!line->image)
+		return false; // Nothing offered yet, it'll get the right one
+	const struct firmware *firmware = iface_firmware(line->ifname);
+	if (!firmware)
+		return false; // Going away anyway
+	if (strcmp(firmware->version, line->image_version) != 0)
+		return true;
+	// The images are shared by content, so the same content is the same image (even under another name)
+	const char *error;
+	struct image *image = image_get(firmware->image_path, &error);
+	return image && image != line->image;
+}
+
+bool line_conns_changed(const struct line *line) {
+	const struct conn_mapping *conns = iface_conns(line->ifname);
+	if (!conns)
+		return false; // Going away anyway
+	for (size_t i = 0; i < MAX_CONN_CNT; i ++)
+		if (!conn_equal(&conns[i], &line->conns[i]))
+			return true;
+	return false;
+}
+
+// Send the mapping of the connection slot state->conn_index
+static const struct transition *conn_transition(struct line *line, struct extra_state *state) {
+	const struct conn_mapping *conns = iface_conns(line->ifname);
 	assert(conns);
+	const struct conn_mapping *conn = &conns[state->conn_index];
+	line->conns[state->conn_index] = *conn;
 	static struct conn_params params;
 	params = (struct conn_params) {
 		.command = CMD_SET_PARAM,
 		.len = htons(sizeof params - 5),
 		.seq = htons(7 + state->conn_index),
 		.param = htonl(PARAM_CONN + state->conn_index),
-		.enable = conns[state->conn_index].active,
+		.enable = conn->active,
 		.l2mode = L2_ATM,
 		.traffic_type = TRAFFIC_EOA,
 		.encap_mode = ENCAP_LLC,
@@ -440,9 +715,9 @@ static const struct transition *send_conn(const char *ifname, struct extra_state
 		// TODO SCR?
 		// TODO MBS?
 		// TODO MCR?
-		.vpi = htons(conns[state->conn_index].vpi),
-		.vci = htons(conns[state->conn_index].vci),
-		.vlan = htons(conns[state->conn_index].vlan),
+		.vpi = htons(conn->vpi),
+		.vci = htons(conn->vci),
+		.vlan = htons(conn->vlan),
 		.vlan_flag = 0
 	};
 	static struct transition result = {
@@ -455,15 +730,30 @@ static const struct transition *send_conn(const char *ifname, struct extra_state
 		.packet_send = true
 	};
 	result.extra_state = state;
-	msg("Sending config\n");
 	return &result;
 }
 
-static const struct transition *check_conn_ack(const char *ifname, struct extra_state *state, const void *packet, size_t packet_size) {
+static const struct transition *send_conn(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)packet;
+	(void)packet_size;
+	if (!state) {
+		state = malloc(sizeof *state);
+		*state = (struct extra_state) {
+			.conn_index = 0
+		};
+	}
+	if (!state->conn_index)
+		line_msg(line, "Sending config\n");
+	return conn_transition(line, state);
+}
+
+static const struct transition *check_conn_ack(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
 	assert(state);
-	const struct transition *result = check_ack(ifname, state, packet, packet_size, 7 + state->conn_index, AS_SEND_CONFIG_CONN);
+	const struct transition *result = check_ack(line, state, packet, packet_size, 7 + state->conn_index, AS_SEND_CONFIG_CONN);
+	if (!result)
+		return NULL; // Not the ack of this slot (maybe a duplicate of the previous one), keep waiting
 	state->conn_index ++;
-	if (result && state->conn_index == MAX_CONN_CNT) {
+	if (state->conn_index == MAX_CONN_CNT) {
 		static struct transition next = {
 			.new_state = AS_WAIT_CONFIG,
 			.state_change = true
@@ -473,12 +763,118 @@ static const struct transition *check_conn_ack(const char *ifname, struct extra_
 	return result;
 }
 
+// Send the next connection mapping that changed. Once they are all sent, go back to watching.
+static const struct transition *reconfig_conn(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)packet;
+	(void)packet_size;
+	const struct conn_mapping *conns = iface_conns(line->ifname);
+	size_t index = state ? state->conn_index : 0;
+	while (conns && index < MAX_CONN_CNT && conn_equal(&conns[index], &line->conns[index]))
+		index ++;
+	if (!conns || index == MAX_CONN_CNT) {
+		static struct transition done = {
+			.new_state = AS_WATCH,
+			.state_change = true
+		};
+		return &done;
+	}
+	if (!state) {
+		line_msg(line, "Connection mappings changed, sending them\n");
+		state = malloc(sizeof *state);
+		*state = (struct extra_state) {
+			.conn_index = 0
+		};
+	}
+	state->conn_index = index;
+	return conn_transition(line, state);
+}
+
+static const struct transition *check_reconfig_ack(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	assert(state);
+	const struct transition *result = check_ack(line, state, packet, packet_size, 7 + state->conn_index, AS_RECONFIG);
+	if (result && result->extra_state == state)
+		state->conn_index ++;
+	return result;
+}
+
+// How often to look if a broken firmware image got fixed (ms)
+#define IMAGE_RECHECK 30000
+
+// The image can't be uploaded. Leave the modem alone, only look at the file from time to time (usually just a stat).
+static const struct transition *invalid_image_enter(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)line;
+	(void)state;
+	(void)packet;
+	(void)packet_size;
+	static const struct transition result = {
+		.timeout = IMAGE_RECHECK,
+		.timeout_jitter = IMAGE_RECHECK / 2,
+		.timeout_slack = IMAGE_RECHECK / 4,
+		.timeout_set = true,
+		.status_name = "invalid firmware"
+	};
+	return &result;
+}
+
+static const struct transition *invalid_image_recheck(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)state;
+	(void)packet;
+	(void)packet_size;
+	const struct firmware *firmware = iface_firmware(line->ifname);
+	if (firmware && usable_image(firmware)) {
+		line_msg(line, "The firmware image is usable now\n");
+		static const struct transition fixed = {
+			.new_state = AS_ASKED_PRESENT,
+			.state_change = true
+		};
+		return &fixed;
+	}
+	// Still broken, just look again later
+	static const struct transition again = {
+		.timeout = IMAGE_RECHECK,
+		.timeout_jitter = IMAGE_RECHECK / 2,
+		.timeout_slack = IMAGE_RECHECK / 4,
+		.timeout_set = true
+	};
+	return &again;
+}
+
+// The first re-probe of a modem that is not present happens after about this many milliseconds
+#define REPROBE_BASE 2000
+
+/*
+ * The modem is not there. But it may be powered on later, so look for it
+ * again after a while. The delay doubles with each unsuccessful probe (up to
+ * the configured maximum) and only its upper half is fixed, the rest is
+ * random. This way many empty ports don't probe all at once.
+ */
+static const struct transition *dead_enter(struct line *line, struct extra_state *state, const void *packet, size_t packet_size) {
+	(void)state;
+	(void)packet;
+	(void)packet_size;
+	uint64_t delay = REPROBE_BASE;
+	for (unsigned i = 0; i < line->dead_probes && delay < (uint64_t)reprobe_max; i ++)
+		delay *= 2;
+	if (delay > (uint64_t)reprobe_max)
+		delay = reprobe_max;
+	line->dead_probes ++;
+	static struct transition result = {
+		.timeout_set = true,
+		.status_name = "not present"
+	};
+	result.timeout = delay / 2 + random() % (delay / 2 + 1);
+	result.timeout_slack = delay / 8;
+	dbg("Looking for the modem again in %d ms\n", result.timeout);
+	return &result;
+}
+
 static struct node_def defs[] = {
 	[AS_PRESTART] = {
 		.actions = {
-			// Just move to initial state
+			// Just move to initial state (spread the interfaces a bit, they usually all come up at once)
 			[AC_ENTER] = {
 				.value = {
+					.timeout_jitter = 500,
 					.timeout_set = true
 				}
 			},
@@ -512,6 +908,21 @@ static struct node_def defs[] = {
 			}
 		}
 	},
+	[AS_UPLOAD_WAIT] = {
+		.actions = {
+			[AC_ENTER] = {
+				.hook = upload_wait
+			},
+			// Woken up by the upload scheduler, the slot is ours
+			[AC_TIMEOUT] = {
+				.value = {
+					.new_state = AS_UPLOAD_WAIT,
+					.state_change = true
+				}
+			},
+			[AC_PACKET] = ACTION_IGNORE
+		}
+	},
 	[AS_ASKED_WANT_IMAGE] = {
 		.actions = {
 			// Send a offer of firmware. If it answers, it wants one. If it doesn't, it is probably already loaded. Just confirm and continue.
@@ -534,7 +945,9 @@ static struct node_def defs[] = {
 			[AC_ENTER] = {
 				.hook = send_image_part
 			},
-			[AC_TIMEOUT] = ACTION_ASK_PRESENT,
+			[AC_TIMEOUT] = {
+				.hook = image_part_timeout
+			},
 			[AC_PACKET] = {
 				.hook = check_image_ack
 			}
@@ -655,10 +1068,7 @@ static struct node_def defs[] = {
 	[AS_WATCH] = {
 		.actions = {
 			[AC_ENTER] = {
-				.value = {
-					.timeout = 60 * 1000, // Ask for alive-status every minute
-					.timeout_set = true
-				}
+				.hook = watch_enter
 			},
 			[AC_TIMEOUT] = {
 				.value = {
@@ -669,14 +1079,36 @@ static struct node_def defs[] = {
 			[AC_PACKET] = ACTION_IGNORE
 		}
 	},
+	[AS_RECONFIG] = {
+		.actions = {
+			[AC_ENTER] = {
+				.hook = reconfig_conn
+			},
+			[AC_TIMEOUT] = ACTION_ASK_PRESENT,
+			[AC_PACKET] = {
+				.hook = check_reconfig_ack
+			}
+		}
+	},
+	[AS_INVALID_IMAGE] = {
+		.actions = {
+			[AC_ENTER] = {
+				.hook = invalid_image_enter
+			},
+			[AC_TIMEOUT] = {
+				.hook = invalid_image_recheck
+			},
+			[AC_PACKET] = ACTION_IGNORE
+		}
+	},
 	[AS_CONFIRM_WORKING] = {
 		.actions = {
 			[AC_ENTER] = {
 				.value = {
-					// Ask every second , up to 5 minutes
-					.timeout = 1000,
-					.timeout_mult = 1,
-					.retries = 79,
+					// Ask for the status. The watchdog decides what to do with the answer (or with its absence).
+					.timeout = 250,
+					.timeout_mult = 2,
+					.retries = 2,
 					.timeout_set = true,
 					.packet = ask_state,
 					.packet_size = sizeof ask_state,
@@ -684,14 +1116,10 @@ static struct node_def defs[] = {
 				}
 			},
 			[AC_TIMEOUT] = {
-				// If it doesn't work for 5 minutes, try resetting it completely
-				.value = {
-					.new_state = AS_RESET,
-					.state_change = true
-				}
+				.hook = check_silence
 			},
 			[AC_PACKET] = {
-				.hook = check_state
+				.hook = check_watch_state
 			}
 		}
 	},
@@ -699,7 +1127,10 @@ static struct node_def defs[] = {
 		.actions = {
 			[AC_ENTER] = {
 				.value = {
-					.timeout = 500,
+					// Ask every 500ms on average, but spread the lines over the interval
+					.timeout = 400,
+					.timeout_jitter = 200,
+					.timeout_slack = 50,
 					.timeout_mult = 1,
 					.retries = 599, // Ask for whole 5 minutes
 					.timeout_set = true,
@@ -742,7 +1173,10 @@ static struct node_def defs[] = {
 		.actions = {
 			[AC_ENTER] = {
 				.value = {
-					.timeout = 500,
+					// Ask every 500ms on average, but spread the lines over the interval
+					.timeout = 400,
+					.timeout_jitter = 200,
+					.timeout_slack = 50,
 					.timeout_mult = 1,
 					.retries = 599, // Ask for whole 5 minutes
 					.timeout_set = true,
@@ -793,19 +1227,19 @@ static struct node_def defs[] = {
 	[AS_DEAD] = {
 		.actions = {
 			[AC_ENTER] = {
-				.value = {
-					.status_name = "not present"
-				}
-			}
+				.hook = dead_enter
+			},
+			[AC_TIMEOUT] = ACTION_ASK_PRESENT,
+			[AC_PACKET] = ACTION_IGNORE
 		}
 	}
 };
 
-static const struct transition *action(const char *ifname, enum autom_state state, enum action action, struct extra_state *extra_state, const void *packet, size_t packet_size) {
+static const struct transition *action(struct line *line, enum autom_state state, enum action action, struct extra_state *extra_state, const void *packet, size_t packet_size) {
 	struct action_def *ad = &defs[state].actions[action];
 	const struct transition *result;
 	if (ad->hook)
-		result = ad->hook(ifname, extra_state, packet, packet_size);
+		result = ad->hook(line, extra_state, packet, packet_size);
 	else
 		result = &ad->value;
 	if (result && result->extra_state != extra_state)
@@ -813,23 +1247,23 @@ static const struct transition *action(const char *ifname, enum autom_state stat
 	return result;
 }
 
-const struct transition *state_enter(const char *ifname, enum autom_state state, struct extra_state *extra_state) {
-	return action(ifname, state, AC_ENTER, extra_state, NULL, 0);
+const struct transition *state_enter(struct line *line, enum autom_state state, struct extra_state *extra_state) {
+	if (state != AS_UPLOAD_WAIT && state != AS_ASKED_WANT_IMAGE && state != AS_SEND_FIRMWARE)
+		upload_release(&line->upload); // Not uploading any more, let the others in
+	return action(line, state, AC_ENTER, extra_state, NULL, 0);
 }
 
-const struct transition *state_timeout(const char *ifname, enum autom_state state, struct extra_state *extra_state) {
-	return action(ifname, state, AC_TIMEOUT, extra_state, NULL, 0);
+const struct transition *state_timeout(struct line *line, enum autom_state state, struct extra_state *extra_state) {
+	return action(line, state, AC_TIMEOUT, extra_state, NULL, 0);
 }
 
-const struct transition *state_packet(const char *ifname, enum autom_state state, struct extra_state *extra_state, const void *packet, size_t packet_size) {
-	return action(ifname, state, AC_PACKET, extra_state, packet, packet_size);
+const struct transition *state_packet(struct line *line, enum autom_state state, struct extra_state *extra_state, const void *packet, size_t packet_size) {
+	return action(line, state, AC_PACKET, extra_state, packet, packet_size);
 }
 
 void extra_state_destroy(struct extra_state *state) {
 	if (state) {
-		if (state->image_fd != -1)
-			if (close(state->image_fd) == -1)
-				die("Couldn't close FD %d: %s\n", state->image_fd, strerror(errno));
+		image_unref(state->image);
 		free(state);
 	}
 }
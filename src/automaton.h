@@ -28,6 +28,8 @@ enum autom_state {
 	AS_PRESTART,
 	// We asked if the modem is there
 	AS_ASKED_PRESENT,
+	// Wait for our turn to upload the image
+	AS_UPLOAD_WAIT,
 	// We asked if there's an image loaded
 	AS_ASKED_WANT_IMAGE,
 	// We are sending the image now
@@ -57,9 +59,18 @@ enum autom_state {
 	// Send a reset command
 	AS_RESET,
 	// Not there or not responding, after fatal heart attack, whatever.
-	AS_DEAD
+	AS_DEAD,
+	// The config file changed, send the connection mappings that differ (without restarting the modem)
+	AS_RECONFIG,
+	// The firmware image can't be uploaded (missing, broken). Wait until it's fixed.
+	AS_INVALID_IMAGE,
+	// Number of the states, not a real state
+	AS_COUNT
 };
 
+// Human readable name of the state
+const char *autom_state_name(enum autom_state state);
+
 struct extra_state;
 
 struct transition {
@@ -69,6 +80,10 @@ struct transition {
 	int timeout_add;
 	int timeout_mult;
 	int retries;
+	// The timeout happens randomly up to this many ms later, to spread the interfaces in time
+	int timeout_jitter;
+	// The timeout may happen up to this many ms late, so it can be handled together with other interfaces
+	int timeout_slack;
 	bool timeout_set;
 	struct extra_state *extra_state;
 	size_t packet_size;
@@ -77,9 +92,15 @@ struct transition {
 	const char *status_name;
 };
 
-const struct transition *state_enter(const char *iface, enum autom_state state, struct extra_state *extra_state);
-const struct transition *state_timeout(const char *iface, enum autom_state state, struct extra_state *extra_state);
-const struct transition *state_packet(const char *iface, enum autom_state, struct extra_state *extra_state, const void *packet, size_t packet_size);
+struct line;
+
+const struct transition *state_enter(struct line *line, enum autom_state state, struct extra_state *extra_state);
+const struct transition *state_timeout(struct line *line, enum autom_state state, struct extra_state *extra_state);
+const struct transition *state_packet(struct line *line, enum autom_state, struct extra_state *extra_state, const void *packet, size_t packet_size);
 void extra_state_destroy(struct extra_state *state);
+// The modem got offered another firmware image or version than what the configuration says now
+bool line_firmware_changed(const struct line *line);
+// The connection mappings of the line are not the ones the modem was configured with
+bool line_conns_changed(const struct line *line);
 
 #endif
@@ -0,0 +1,209 @@
+#!/bin/sh
+
+# SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+# Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Benchmarks of the daemon, with the results compared to a baseline.
+#
+# Usage: bench.sh <results> [<baseline>]
+#
+# The results are written into the results file, one "<name> <value>" per
+# line. The simulated part runs anywhere and in virtual time, so its numbers
+# don't depend on the machine. The live part runs the daemon against the
+# emulator on veth pairs, so it needs root; it is skipped otherwise.
+#
+# Each baseline line is "<name> <value> lower|higher <tolerance_%>", where
+# lower or higher tells which direction is better. A result worse than the
+# value by more than the tolerance is a regression and the script fails.
+#
+# The binaries are taken from the directory of this script, or from $BIN.
+# $LINES sets the number of lines of the live part and $IDLE for how many
+# seconds the idle lines are measured.
+
+set -e
+
+RESULTS=${1:?Usage: bench.sh <results> [<baseline>]}
+BASELINE=$2
+BIN=${BIN:-$(dirname "$0")}
+LINES=${LINES:-50}
+IDLE=${IDLE:-30}
+SEED=1
+VERSION=bench
+IMAGE_SIZE=1048576
+
+: >"$RESULTS"
+
+record() {
+	echo "$1 $2" >>"$RESULTS"
+}
+
+# Pick the value of the key=value field from a line
+field() {
+	echo "$1" | tr ' ' '\n' | sed -ne "s/^$2=//p"
+}
+
+sim() {
+	"$BIN/smrt-sim" -s $SEED -S $IMAGE_SIZE "$@"
+}
+
+# The simulated part (the times are virtual milliseconds)
+
+OUT=$(sim -n 1 -H 0 -t 0 -d 120 | grep '^result')
+record upload_single_ms $(field "$OUT" max)
+
+# All the modems get the image at once (as many as the daemon lets in)
+OUT=$(sim -n 50 -H 0 -t 0 -d 1800 | grep '^result')
+record upload_concurrent_kbytes_per_s $((50 * IMAGE_SIZE / $(field "$OUT" max) * 1000 / 1024))
+
+OUT=$(sim -n 100 -d 1800)
+RESULT=$(echo "$OUT" | grep '^result')
+record online_cold_p50_ms $(field "$RESULT" p50)
+record online_cold_p99_ms $(field "$RESULT" p99)
+record sim_transitions_per_second $(field "$(echo "$OUT" | grep '^speed')" transitions_per_second)
+
+# The modems already run the firmware, only the daemon starts
+OUT=$(sim -n 100 -d 1800 -W | grep '^result')
+record online_warm_p50_ms $(field "$OUT" p50)
+record online_warm_p99_ms $(field "$OUT" p99)
+
+# The codec microbenchmarks (the times depend on the machine, the counts don't)
+"$BIN/smrt-codec-bench" -n 100000 | while read CODEC NAME FIELDS ; do
+	record codec_${NAME}_ns $(field "$FIELDS" ns_per_frame)
+	record codec_${NAME}_mallocs $(field "$FIELDS" mallocs_per_frame)
+	record codec_${NAME}_copied_bytes $(field "$FIELDS" bytes_copied_per_frame)
+done
+
+# The live part
+
+# Time the process spent on CPU (ns)
+cpu_ns() {
+	cut -d' ' -f1 /proc/$1/schedstat
+}
+
+proc_status() {
+	sed -ne "s/^$2:[[:space:]]*\([0-9]*\).*/\1/p" /proc/$1/status
+}
+
+live() {
+	WORK=$(mktemp -d)
+	DAEMON=
+	EMU=
+	cleanup() {
+		kill $DAEMON $EMU 2>/dev/null || true
+		wait || true
+		i=0
+		while [ $i -lt $LINES ] ; do
+			ip link del bd$i 2>/dev/null || true
+			i=$((i + 1))
+		done
+		rm -rf "$WORK"
+	}
+	trap cleanup EXIT INT TERM
+	i=0
+	DAEMON_IFACES=
+	EMU_IFACES=
+	while [ $i -lt $LINES ] ; do
+		ip link add bd$i type veth peer name bm$i
+		ip link set bm$i up
+		DAEMON_IFACES="$DAEMON_IFACES -i bd$i"
+		EMU_IFACES="$EMU_IFACES bm$i"
+		i=$((i + 1))
+	done
+	head -c $IMAGE_SIZE /dev/urandom >"$WORK/image"
+	mkdir "$WORK/status"
+	"$BIN/smrt-emu" -s $SEED -v $VERSION $EMU_IFACES >"$WORK/emu" 2>&1 &
+	EMU=$!
+	"$BIN/smrtd" $DAEMON_IFACES -f "$WORK/image" -v $VERSION -s "$WORK/status" -m "$WORK/shm" -l error 2>"$WORK/daemon" &
+	DAEMON=$!
+	sleep 1
+	# Without any interface up, so the memory per interface can be told
+	RSS_EMPTY=$(proc_status $DAEMON VmRSS)
+	i=0
+	while [ $i -lt $LINES ] ; do
+		ip link set bd$i up
+		i=$((i + 1))
+	done
+	WAITED=0
+	while [ $("$BIN/smrt-status" "$WORK/shm" | grep -c ': online ') -lt $LINES ] ; do
+		WAITED=$((WAITED + 1))
+		[ $WAITED -gt 600 ] && { echo "The lines didn't get online" >&2 ; exit 1 ; }
+		sleep 1
+	done
+	record live_rss_kbytes_per_line $(( ($(proc_status $DAEMON VmRSS) - RSS_EMPTY) / LINES ))
+	# Idle lines, only the periodic checks happen
+	CPU=$(cpu_ns $DAEMON)
+	WAKEUPS=$(proc_status $DAEMON voluntary_ctxt_switches)
+	sleep $IDLE
+	record live_idle_cpu_ns_per_line_per_s $(( ($(cpu_ns $DAEMON) - CPU) / LINES / IDLE ))
+	# In thousandths, there's much less than one wakeup per line each second
+	record live_idle_wakeups_per_line_per_ks $(( ($(proc_status $DAEMON voluntary_ctxt_switches) - WAKEUPS) * 1000 / LINES / IDLE ))
+	# One line going down and up, while all the others are watched
+	CPU=$(cpu_ns $DAEMON)
+	i=0
+	while [ $i -lt 20 ] ; do
+		ip link set bd0 down
+		ip link set bd0 up
+		i=$((i + 1))
+	done
+	sleep 1
+	record live_link_event_us $(( ($(cpu_ns $DAEMON) - CPU) / 1000 / 40 ))
+	kill $EMU
+	wait $EMU || true
+	EMU=
+	record live_online_p50_ms $(field "$(grep '^result' "$WORK/emu")" p50)
+}
+
+if [ "$(id -u)" = 0 ] ; then
+	(live)
+else
+	echo "Not root, skipping the live benchmarks" >&2
+fi
+
+# The comparison
+
+[ -z "$BASELINE" ] && { cat "$RESULTS" ; exit 0 ; }
+awk -v results="$RESULTS" '
+BEGIN {
+	while ((getline line < results) > 0) {
+		split(line, f, " ")
+		result[f[1]] = f[2]
+	}
+	printf "%-36s %12s %12s %8s\n", "benchmark", "baseline", "result", "change"
+}
+/^#/ || NF < 4 { next }
+{
+	if (!($1 in result)) {
+		printf "%-36s %12s %12s %8s\n", $1, $2, "-", "skipped"
+		next
+	}
+	value = result[$1]
+	if ($2 != 0) {
+		change = (value - $2) * 100 / $2
+		shown = sprintf("%+.1f%%", change)
+	} else {
+		# Anything is infinitely more than nothing
+		change = value > 0 ? 1e9 : value < 0 ? -1e9 : 0
+		shown = change ? "new" : "+0.0%"
+	}
+	worse = $3 == "lower" ? change : -change
+	verdict = worse > $4 ? "REGRESSION" : ""
+	if (verdict)
+		failed = 1
+	printf "%-36s %12s %12s %8s %s\n", $1, $2, value, shown, verdict
+}
+END {
+	exit failed
+}' "$BASELINE"
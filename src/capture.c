@@ -0,0 +1,184 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "capture.h"
+#include "configuration.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+bool capture_on;
+
+static struct capture *registered;
+
+struct pcap_header {
+	uint32_t magic;
+	uint16_t version_major, version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs, snaplen, network;
+};
+
+struct pcap_record {
+	uint32_t ts_sec, ts_usec, incl_len, orig_len;
+};
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_ETHERNET 1
+
+void capture_init(struct capture *capture, const char *ifname) {
+	*capture = (struct capture) {
+		.ifname = ifname,
+		.fd = -1,
+		.next = registered
+	};
+	if (registered)
+		registered->prev = capture;
+	registered = capture;
+}
+
+static char *file_path(const struct capture *capture, bool old) {
+	// The directory, slash, name, ".pcap", ".1" and the terminating '\0'
+	char *path = malloc(strlen(capture_path) + strlen(capture->ifname) + 9);
+	sprintf(path, "%s/%s.pcap%s", capture_path, capture->ifname, old ? ".1" : "");
+	return path;
+}
+
+static void file_close(struct capture *capture) {
+	if (capture->fd != -1 && close(capture->fd) == -1)
+		error_msg("Couldn't close capture file of %s: %s\n", capture->ifname, strerror(errno));
+	capture->fd = -1;
+}
+
+static bool full_write(struct capture *capture, const void *data, size_t size) {
+	while (size) {
+		ssize_t written = write(capture->fd, data, size);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			error_msg("Couldn't write capture of %s: %s\n", capture->ifname, strerror(errno));
+			file_close(capture);
+			return false;
+		}
+		data = (const uint8_t *)data + written;
+		size -= written;
+		capture->file_size += written;
+	}
+	return true;
+}
+
+// Start a new file, keeping the current one as the old one
+static bool file_open(struct capture *capture) {
+	file_close(capture);
+	char *path = file_path(capture, false);
+	char *old = file_path(capture, true);
+	if (rename(path, old) == -1 && errno != ENOENT)
+		error_msg("Couldn't rotate capture file %s: %s\n", path, strerror(errno));
+	capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture->fd == -1)
+		error_msg("Couldn't open capture file %s: %s\n", path, strerror(errno));
+	free(path);
+	free(old);
+	if (capture->fd == -1)
+		return false;
+	capture->file_size = 0;
+	const struct pcap_header header = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = 65535,
+		.network = LINKTYPE_ETHERNET
+	};
+	return full_write(capture, &header, sizeof header);
+}
+
+static void buffer_write(struct capture *capture) {
+	if (!capture->buffer_len)
+		return;
+	if ((capture->fd == -1 || capture->file_size + capture->buffer_len > CAPTURE_FILE_MAX) && !file_open(capture)) {
+		capture->buffer_len = 0; // Lost, but we can't do better
+		return;
+	}
+	full_write(capture, capture->buffer, capture->buffer_len);
+	capture->buffer_len = 0;
+}
+
+void capture_store(struct capture *capture, uint64_t now, const void *frame, size_t size) {
+	size_t needed = sizeof(struct pcap_record) + size;
+	if (needed > CAPTURE_BUFFER)
+		return; // Would never fit
+	if (capture->buffer_len + needed > CAPTURE_BUFFER)
+		buffer_write(capture);
+	if (!capture->buffer)
+		capture->buffer = malloc(CAPTURE_BUFFER);
+	if (!capture->buffer_len)
+		capture->buffered_since = now;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	const struct pcap_record record = {
+		.ts_sec = ts.tv_sec,
+		.ts_usec = ts.tv_nsec / 1000,
+		.incl_len = size,
+		.orig_len = size
+	};
+	memcpy(capture->buffer + capture->buffer_len, &record, sizeof record);
+	memcpy(capture->buffer + capture->buffer_len + sizeof record, frame, size);
+	capture->buffer_len += needed;
+}
+
+void capture_destroy(struct capture *capture) {
+	buffer_write(capture);
+	file_close(capture);
+	free(capture->buffer);
+	if (capture->prev)
+		capture->prev->next = capture->next;
+	else
+		registered = capture->next;
+	if (capture->next)
+		capture->next->prev = capture->prev;
+}
+
+void capture_flush(uint64_t now, bool force) {
+	for (struct capture *c = registered; c; c = c->next)
+		if (c->buffer_len && (force || now - c->buffered_since >= CAPTURE_DELAY))
+			buffer_write(c);
+}
+
+bool capture_pending(void) {
+	for (const struct capture *c = registered; c; c = c->next)
+		if (c->buffer_len)
+			return true;
+	return false;
+}
+
+void capture_enable(bool enable) {
+	if (!capture_path)
+		return;
+	if (capture_on && !enable)
+		for (struct capture *c = registered; c; c = c->next) {
+			buffer_write(c);
+			file_close(c);
+		}
+	if (capture_on != enable)
+		msg("Frame capture %s\n", enable ? "started" : "stopped");
+	capture_on = enable;
+}
@@ -0,0 +1,73 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_CAPTURE_H
+#define SMRT_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Recording of the frames exchanged with the modems into pcap files, one
+ * pair for each interface. When a file grows over the limit, it replaces
+ * the older one and a new one is started, so there's always the recent
+ * part of the conversation and the size is bounded.
+ *
+ * The frames are first stored in a buffer and written from the main loop,
+ * in bigger pieces.
+ */
+
+// Size of one file, there are two of them for each interface
+#define CAPTURE_FILE_MAX (1024 * 1024)
+#define CAPTURE_BUFFER (32 * 1024)
+// How long may the frames wait in the buffer (ms)
+#define CAPTURE_DELAY 1000
+
+struct capture {
+	const char *ifname;
+	// The current file (-1 if not open)
+	int fd;
+	size_t file_size;
+	uint8_t *buffer;
+	size_t buffer_len;
+	// When the oldest frame in the buffer was stored
+	uint64_t buffered_since;
+	struct capture *next, *prev;
+};
+
+// Is the capture running now?
+extern bool capture_on;
+
+void capture_init(struct capture *capture, const char *ifname);
+void capture_destroy(struct capture *capture);
+void capture_store(struct capture *capture, uint64_t now, const void *frame, size_t size);
+
+static inline void capture_frame(struct capture *capture, uint64_t now, const void *frame, size_t size) {
+	if (capture_on)
+		capture_store(capture, now, frame, size);
+}
+
+// Start or stop the capture (stopping writes everything buffered)
+void capture_enable(bool enable);
+// Write the buffers that waited long enough (all of them if force is set)
+void capture_flush(uint64_t now, bool force);
+// Is there something waiting in the buffers?
+bool capture_pending(void);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of encoding and decoding the frames. Each codec path of the
+ * automaton and the interface runs alone many times and is measured for the
+ * time, the allocations and the bytes copied per frame. The allocator and
+ * memcpy are interposed here to count them.
+ */
+
+#include "automaton.h"
+#include "interface.h"
+#include "configuration.h"
+#include "line.h"
+#include "proto_const.h"
+#include "util.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+// Counted only while a benchmark runs
+static bool counting;
+static uint64_t mallocs, copied;
+
+static void *(*real_malloc)(size_t size);
+static void *(*real_calloc)(size_t count, size_t size);
+static void *(*real_realloc)(void *ptr, size_t size);
+static void (*real_free)(void *ptr);
+static void *(*real_memcpy)(void *dest, const void *src, size_t size);
+
+/*
+ * The dynamic linker may allocate while looking the real functions up. That
+ * is served from this buffer, which is never freed.
+ */
+static uint8_t bootstrap[4096];
+static size_t bootstrap_used;
+static bool resolving;
+
+static void resolve(void) {
+	resolving = true;
+	// ISO C doesn't allow converting void * to a function pointer, so store the symbol through an object pointer (as POSIX suggests)
+	*(void **)&real_malloc = dlsym(RTLD_NEXT, "malloc");
+	*(void **)&real_calloc = dlsym(RTLD_NEXT, "calloc");
+	*(void **)&real_realloc = dlsym(RTLD_NEXT, "realloc");
+	*(void **)&real_free = dlsym(RTLD_NEXT, "free");
+	*(void **)&real_memcpy = dlsym(RTLD_NEXT, "memcpy");
+	resolving = false;
+}
+
+static void *bootstrap_alloc(size_t size) {
+	size = (size + 15) & ~(size_t)15;
+	if (bootstrap_used + size > sizeof bootstrap)
+		return NULL;
+	void *result = bootstrap + bootstrap_used;
+	bootstrap_used += size;
+	return result;
+}
+
+void *malloc(size_t size) {
+	if (!real_malloc) {
+		if (resolving)
+			return bootstrap_alloc(size);
+		resolve();
+	}
+	if (counting)
+		mallocs ++;
+	return real_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	if (!real_calloc) {
+		if (resolving)
+			return bootstrap_alloc(count * size); // Static, so already zeroed
+		resolve();
+	}
+	if (counting)
+		mallocs ++;
+	return real_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (!real_realloc)
+		resolve();
+	if (counting)
+		mallocs ++;
+	return real_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	if ((uint8_t *)ptr >= bootstrap && (uint8_t *)ptr < bootstrap + sizeof bootstrap)
+		return;
+	if (!real_free)
+		resolve();
+	real_free(ptr);
+}
+
+// Only the copies the compiler doesn't inline (the ones of variable size) are seen
+void *memcpy(void *restrict dest, const void *restrict src, size_t size) {
+	if (counting)
+		copied += size;
+	if (real_memcpy)
+		return real_memcpy(dest, src, size);
+	// Before the lookup (it may copy too)
+	volatile uint8_t *d = dest;
+	const volatile uint8_t *s = src;
+	for (size_t i = 0; i < size; i ++)
+		d[i] = s[i];
+	return dest;
+}
+
+static uint64_t clock_ns(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		die("Couldn't get time: %s\n", strerror(errno));
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static size_t iterations = 100000;
+static uint64_t started;
+
+static void measure_start(void) {
+	mallocs = copied = 0;
+	counting = true;
+	started = clock_ns();
+}
+
+static void measure_stop(const char *name) {
+	uint64_t duration = clock_ns() - started;
+	counting = false;
+	printf("codec %s ns_per_frame=%.1f mallocs_per_frame=%.3f bytes_copied_per_frame=%.1f\n", name, (double)duration / iterations, (double)mallocs / iterations, (double)copied / iterations);
+}
+
+static const uint8_t modem_mac[ETH_ALEN] = { 6, 5, 4, 3, 2, 1 };
+static const uint8_t line_mac[ETH_ALEN] = { 2, 0, 0, 0, 0, 1 };
+
+// The layout of the answers, as the modem sends them
+
+struct img_ack {
+	uint8_t cmd;
+	uint32_t status;
+} __attribute__((packed));
+
+struct version_answer {
+	uint8_t cmd;
+	uint16_t len;
+	uint16_t seq;
+	uint32_t param;
+	char fw[20];
+	char dsp[20];
+} __attribute__((packed));
+
+struct status_answer {
+	uint8_t cmd;
+	uint16_t len;
+	uint16_t seq;
+	uint32_t param;
+	uint8_t annex;
+	uint8_t standard;
+	uint8_t state;
+	uint8_t power;
+	uint8_t data_path;
+	uint32_t dsmax;
+	uint32_t usmax;
+	uint32_t dscur;
+	uint32_t uscur;
+	uint16_t dspower;
+	uint16_t uspower;
+} __attribute__((packed));
+
+struct param_ack_frame {
+	struct ethhdr hdr;
+	uint8_t cmd;
+	uint16_t len;
+	uint16_t seq;
+	uint8_t error;
+} __attribute__((packed));
+
+static struct line line;
+
+// The same as an interface sets up for its line, but without the interface around
+static void line_setup(void) {
+	line = (struct line) {
+		.ifname = "bench0",
+		.now = 1000,
+		.mtu = 1500,
+		.shm_slot = -1
+	};
+	status_init(&line.status, line.ifname);
+	line.history = history_alloc();
+	metrics_register(&line.metrics, line.ifname);
+	watchdog_init(&line.watchdog);
+}
+
+static void line_teardown(void) {
+	upload_release(&line.upload);
+	status_destroy(&line.status);
+	history_destroy(line.history);
+	image_unref(line.image);
+	free(line.image_version);
+	metrics_unregister(&line.metrics);
+}
+
+// send_image_part: reading the image and filling in the part
+static void bench_image_part(void) {
+	const struct img_ack proceed = {
+		.cmd = CMD_IMG_ACK,
+		.status = htonl(IMG_PROCEED)
+	};
+	upload_admit(&line.upload);
+	struct extra_state *offer = state_enter(&line, AS_ASKED_WANT_IMAGE, NULL)->extra_state;
+	struct extra_state *extra = state_packet(&line, AS_ASKED_WANT_IMAGE, offer, &proceed, sizeof proceed)->extra_state;
+	measure_start();
+	for (size_t i = 0; i < iterations; i ++)
+		state_enter(&line, AS_SEND_FIRMWARE, extra);
+	measure_stop("image_part_encode");
+	extra_state_destroy(extra);
+	upload_release(&line.upload);
+}
+
+// send_conn: the connection mapping parameters
+static void bench_conn(void) {
+	struct extra_state *extra = state_enter(&line, AS_SEND_CONFIG_CONN, NULL)->extra_state;
+	measure_start();
+	for (size_t i = 0; i < iterations; i ++)
+		state_enter(&line, AS_SEND_CONFIG_CONN, extra);
+	measure_stop("conn_encode");
+	extra_state_destroy(extra);
+}
+
+// check_version: the answer with the firmware version
+static void bench_version(void) {
+	struct version_answer answer = {
+		.cmd = CMD_ANSWER_PARAM,
+		.len = htons(sizeof answer - 5),
+		.seq = htons(2),
+		.param = htonl(PARAM_VERSION)
+	};
+	strncpy(answer.fw, fw_version, sizeof answer.fw - 1);
+	measure_start();
+	for (size_t i = 0; i < iterations; i ++)
+		state_packet(&line, AS_ASKED_VERSION, NULL, &answer, sizeof answer);
+	measure_stop("version_decode");
+}
+
+// check_watch_state: the periodic status answer, written into the status file (unchanged, so not rewritten), the history and the watchdog
+static void bench_status(void) {
+	const struct status_answer answer = {
+		.cmd = CMD_ANSWER_PARAM,
+		.len = htons(sizeof answer - 5),
+		.seq = htons(4),
+		.param = htonl(PARAM_STATUS),
+		.annex = 1,
+		.standard = 5,
+		.state = STATE_OK,
+		.data_path = 1,
+		.dsmax = htonl(24000),
+		.usmax = htonl(1200),
+		.dscur = htonl(20000),
+		.uscur = htonl(1000),
+		.dspower = htons(180),
+		.uspower = htons(120)
+	};
+	measure_start();
+	for (size_t i = 0; i < iterations; i ++) {
+		line.now += 10000; // One answer per period of the watch
+		state_packet(&line, AS_CONFIRM_WORKING, NULL, &answer, sizeof answer);
+	}
+	measure_stop("status_decode");
+}
+
+static void discard(void *data, const void *frame, size_t size) {
+	(void)data;
+	(void)frame;
+	(void)size;
+}
+
+// packet_send: a transition sending a frame (the reset), with the ethernet header put around it
+static void bench_send(struct interface_state *interface) {
+	uint64_t now = 1000;
+	measure_start();
+	for (size_t i = 0; i < iterations; i ++)
+		interface_command(interface, now ++, IC_RESET);
+	measure_stop("frame_send");
+}
+
+// interface_read without the recv: checking the header and passing the frame to the automaton (which ignores it in the reset)
+static void bench_receive(struct interface_state *interface) {
+	struct param_ack_frame frame = {
+		.hdr.h_proto = htons(CONTROL_PROTOCOL),
+		.cmd = CMD_PARAM_ACK,
+		.len = htons(1),
+		.seq = htons(5)
+	};
+	memcpy(frame.hdr.h_dest, line_mac, ETH_ALEN);
+	memcpy(frame.hdr.h_source, modem_mac, ETH_ALEN);
+	uint64_t now = 1000;
+	measure_start();
+	for (size_t i = 0; i < iterations; i ++)
+		interface_input(interface, now ++, (const uint8_t *)&frame, sizeof frame);
+	measure_stop("frame_receive");
+}
+
+int main(int argc, char *argv[]) {
+	int option;
+	while ((option = getopt(argc, argv, "n:")) != -1) {
+		switch (option) {
+			case 'n':
+				iterations = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (!iterations)
+		die("At least one iteration is needed\n");
+	char dir[] = "/tmp/smrt-codec.XXXXXX";
+	if (!mkdtemp(dir))
+		die("Couldn't create a temporary directory: %s\n", strerror(errno));
+	char image[sizeof dir + 16];
+	snprintf(image, sizeof image, "%s/image", dir);
+	int fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		die("Couldn't create %s: %s\n", image, strerror(errno));
+	uint8_t part[MAX_DATA_PAYLOAD] = { 0 };
+	if (write(fd, part, sizeof part) != sizeof part || close(fd) == -1)
+		die("Couldn't write %s: %s\n", image, strerror(errno));
+	char *daemon_argv[] = { argv[0], "-f", image, "-v", "bench", "-s", dir, "-l", "error", "-i", "bench0", NULL };
+	optind = 0;
+	configure(sizeof daemon_argv / sizeof *daemon_argv - 1, daemon_argv);
+	line_setup();
+	bench_image_part();
+	bench_conn();
+	bench_version();
+	bench_status();
+	line_teardown();
+	struct interface_state *interface = interface_alloc_virtual("bench1", 1000, 1, line_mac, 1500, discard, NULL, NULL);
+	bench_send(interface);
+	bench_receive(interface);
+	interface_release(interface);
+	if (unlink(image) == -1)
+		die("Couldn't remove %s: %s\n", image, strerror(errno));
+	if (rmdir(dir) == -1)
+		error_msg("Couldn't remove %s: %s\n", dir, strerror(errno));
+	return 0;
+}
@@ -18,8 +18,11 @@
 
 #include "configuration.h"
 #include "netstate.h"
+#include "image.h"
 #include "util.h"
 
+#include <errno.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,11 +32,321 @@ struct interface {
 	const char *name;
 	struct conn_mapping mappings[MAX_CONN_CNT];
 	size_t mapping_count;
+	struct firmware firmware;
+	// Put together from the config file by iface_conns (not from the command line)
+	bool owned;
 };
 
+// The interfaces from the command line
 static struct interface *interfaces;
 static size_t interface_count;
 
+// Settings of the connection slots, as written in a template or an interface block of the config file
+struct slots {
+	bool set[MAX_CONN_CNT];
+	struct conn_mapping mappings[MAX_CONN_CNT];
+};
+
+struct template {
+	char *name;
+	struct slots slots;
+};
+
+struct block {
+	char *pattern;
+	struct slots slots;
+	// The firmware for the matching interfaces (the image_path is NULL if the block doesn't set it)
+	struct firmware firmware;
+};
+
+// Everything read from the config file. Replaced as a whole on reload.
+struct config_file {
+	struct template *templates;
+	size_t template_count;
+	// In the order of the file, the later ones override the earlier ones
+	struct block *blocks;
+	size_t block_count;
+	// From the firmware line outside of the blocks, for all the interfaces (the image_path is NULL if there's none)
+	struct firmware firmware;
+};
+
+static struct config_file file;
+static const char *file_path;
+// The firmware from the command line, used when the config file doesn't set one
+static const char *cmdline_image_path;
+static const char *cmdline_fw_version;
+// The firmware of the interfaces no block sets it for
+static struct firmware default_firmware;
+
+/*
+ * The resolved interfaces (both from the command line and the config file),
+ * by their name. Chained, the number of buckets is a power of two.
+ */
+struct resolved {
+	struct interface *interface;
+	struct resolved *next;
+};
+
+static struct resolved **table;
+static size_t table_size, table_count;
+
+// FNV-1a
+static size_t name_hash(const char *name) {
+	uint32_t hash = 2166136261U;
+	for (; *name; name ++)
+		hash = (hash ^ (uint8_t)*name) * 16777619U;
+	return hash;
+}
+
+static struct interface *table_find(const char *name) {
+	if (!table_size)
+		return NULL;
+	for (struct resolved *r = table[name_hash(name) & (table_size - 1)]; r; r = r->next)
+		if (strcmp(r->interface->name, name) == 0)
+			return r->interface;
+	return NULL;
+}
+
+static void table_insert(struct interface *interface) {
+	if (table_count >= table_size) {
+		// Grow and rehash, so the chains stay short
+		size_t new_size = table_size ? 2 * table_size : 64;
+		struct resolved **new_table = calloc(new_size, sizeof *new_table);
+		for (size_t i = 0; i < table_size; i ++)
+			while (table[i]) {
+				struct resolved *r = table[i];
+				table[i] = r->next;
+				size_t bucket = name_hash(r->interface->name) & (new_size - 1);
+				r->next = new_table[bucket];
+				new_table[bucket] = r;
+			}
+		free(table);
+		table = new_table;
+		table_size = new_size;
+	}
+	struct resolved *r = malloc(sizeof *r);
+	size_t bucket = name_hash(interface->name) & (table_size - 1);
+	*r = (struct resolved) {
+		.interface = interface,
+		.next = table[bucket]
+	};
+	table[bucket] = r;
+	table_count ++;
+}
+
+// Forget everything resolved, the config file changed. Only the command line interfaces are put back.
+static void table_reset(void) {
+	for (size_t i = 0; i < table_size; i ++)
+		while (table[i]) {
+			struct resolved *r = table[i];
+			table[i] = r->next;
+			if (r->interface->owned) {
+				free((char *)r->interface->name);
+				free(r->interface);
+			}
+			free(r);
+		}
+	table_count = 0;
+	for (size_t i = 0; i < interface_count; i ++) {
+		interfaces[i].firmware = default_firmware;
+		table_insert(&interfaces[i]);
+	}
+}
+
+static bool is_pattern(const char *name) {
+	return strpbrk(name, "*?[") != NULL;
+}
+
+static void slots_apply(struct slots *dest, const struct slots *src) {
+	for (size_t i = 0; i < MAX_CONN_CNT; i ++)
+		if (src->set[i]) {
+			dest->set[i] = true;
+			dest->mappings[i] = src->mappings[i];
+		}
+}
+
+// Split the line into words (in place), return their count
+static size_t split(char *line, char *words[], size_t max) {
+	size_t count = 0;
+	char *save;
+	for (char *word = strtok_r(line, " \t\r\n", &save); word && count < max; word = strtok_r(NULL, " \t\r\n", &save)) {
+		if (*word == '#')
+			break;
+		words[count ++] = word;
+	}
+	return count;
+}
+
+static bool file_num(const char *word, int *result) {
+	char *end;
+	*result = strtol(word, &end, 10);
+	return *word && !*end;
+}
+
+static void firmware_free(struct firmware *firmware) {
+	free((char *)firmware->image_path);
+	free((char *)firmware->version);
+}
+
+static void config_file_free(struct config_file *config) {
+	for (size_t i = 0; i < config->template_count; i ++)
+		free(config->templates[i].name);
+	free(config->templates);
+	for (size_t i = 0; i < config->block_count; i ++) {
+		free(config->blocks[i].pattern);
+		firmware_free(&config->blocks[i].firmware);
+	}
+	free(config->blocks);
+	firmware_free(&config->firmware);
+	*config = (struct config_file) { .templates = NULL };
+}
+
+/*
+ * Read the config file into config. Returns the error (and leaves config
+ * empty) if the file can't be read or is not valid.
+ */
+static const char *config_file_read(const char *path, struct config_file *config) {
+	static char error[256];
+	*config = (struct config_file) { .templates = NULL };
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		snprintf(error, sizeof error, "Couldn't open config file %s: %s", path, strerror(errno));
+		return error;
+	}
+	char *line = NULL;
+	size_t line_size = 0, line_no = 0;
+	// Where the conn and use lines go (the last template or interface)
+	struct slots *current = NULL;
+	// Where the firmware line goes (the last interface, NULL if it's a template)
+	struct block *current_block = NULL;
+	*error = '\0';
+	while (!*error && getline(&line, &line_size, f) != -1) {
+		line_no ++;
+		char *words[6];
+		size_t count = split(line, words, sizeof words / sizeof *words);
+		int slot, vlan, vpi, vci;
+		if (!count)
+			continue;
+		if (strcmp(words[0], "template") == 0 && count == 2) {
+			config->templates = realloc(config->templates, (++ config->template_count) * sizeof *config->templates);
+			config->templates[config->template_count - 1] = (struct template) {
+				.name = strdup(words[1])
+			};
+			current = &config->templates[config->template_count - 1].slots;
+			current_block = NULL;
+		} else if (strcmp(words[0], "interface") == 0 && count == 2) {
+			config->blocks = realloc(config->blocks, (++ config->block_count) * sizeof *config->blocks);
+			config->blocks[config->block_count - 1] = (struct block) {
+				.pattern = strdup(words[1])
+			};
+			current_block = &config->blocks[config->block_count - 1];
+			current = &current_block->slots;
+		} else if (strcmp(words[0], "firmware") == 0 && (count == 3 || count == 4)) {
+			struct firmware *firmware = current_block ? &current_block->firmware : &config->firmware;
+			if (current && !current_block)
+				snprintf(error, sizeof error, "%s:%zu: The firmware can't be set in a template", path, line_no);
+			firmware_free(firmware);
+			*firmware = (struct firmware) {
+				.image_path = strdup(words[1]),
+				.version = strdup(words[2]),
+				.crc_set = count == 4
+			};
+			char *end;
+			if (count == 4)
+				firmware->crc = strtoul(words[3], &end, 16);
+			if (count == 4 && (!*words[3] || *end))
+				snprintf(error, sizeof error, "%s:%zu: %s is not a valid CRC32", path, line_no, words[3]);
+		} else if (!current) {
+			snprintf(error, sizeof error, "%s:%zu: %s outside of a template or an interface", path, line_no, words[0]);
+		} else if (strcmp(words[0], "use") == 0 && count == 2) {
+			const struct template *t = NULL;
+			for (size_t i = 0; i < config->template_count; i ++)
+				if (strcmp(config->templates[i].name, words[1]) == 0)
+					t = &config->templates[i];
+			if (t)
+				slots_apply(current, &t->slots);
+			else
+				snprintf(error, sizeof error, "%s:%zu: Unknown template %s", path, line_no, words[1]);
+		} else if (strcmp(words[0], "conn") == 0 && (count == 5 || (count == 3 && strcmp(words[2], "off") == 0))) {
+			if (!file_num(words[1], &slot) || (count == 5 && !(file_num(words[2], &vlan) && file_num(words[3], &vpi) && file_num(words[4], &vci))))
+				snprintf(error, sizeof error, "%s:%zu: Not a valid number", path, line_no);
+			else if (slot < 0 || slot >= MAX_CONN_CNT)
+				snprintf(error, sizeof error, "%s:%zu: Connection slot %d out of range 0-%d", path, line_no, slot, MAX_CONN_CNT - 1);
+			else {
+				current->set[slot] = true;
+				if (count == 5)
+					current->mappings[slot] = (struct conn_mapping) {
+						.vlan = vlan,
+						.vpi = vpi,
+						.vci = vci,
+						.active = true
+					};
+				else
+					current->mappings[slot] = (struct conn_mapping) { .active = false };
+			}
+		} else
+			snprintf(error, sizeof error, "%s:%zu: Invalid line", path, line_no);
+	}
+	if (!*error && ferror(f))
+		snprintf(error, sizeof error, "Couldn't read config file %s: %s", path, strerror(errno));
+	free(line);
+	fclose(f);
+	if (*error) {
+		config_file_free(config);
+		return error;
+	}
+	return NULL;
+}
+
+// Load and check the image, so a missing or broken one is found right away
+static const char *firmware_check(const struct firmware *firmware) {
+	static char buffer[512];
+	const char *problem;
+	const struct image *image = image_get(firmware->image_path, &problem);
+	if (image)
+		problem = image_check(image, firmware->crc_set, firmware->crc);
+	// It gets reported here, the lines don't need to report it again
+	image_report(firmware->image_path, problem);
+	if (!problem)
+		return NULL;
+	snprintf(buffer, sizeof buffer, "Firmware image %s: %s", firmware->image_path, problem);
+	return buffer;
+}
+
+// Check all the images the config refers to
+static const char *config_file_images(const struct config_file *config) {
+	struct firmware firmware = config->firmware;
+	if (!firmware.image_path)
+		firmware = (struct firmware) {
+			.image_path = cmdline_image_path,
+			.version = cmdline_fw_version
+		};
+	if (!firmware.image_path || !firmware.version)
+		return "The firmware not set";
+	const char *error = firmware_check(&firmware);
+	for (size_t i = 0; i < config->block_count && !error; i ++)
+		if (config->blocks[i].firmware.image_path)
+			error = firmware_check(&config->blocks[i].firmware);
+	return error;
+}
+
+// Start using the config file
+static void config_file_apply(void) {
+	// Interfaces without a pattern are watched from the start, like the ones from the command line
+	for (size_t i = 0; i < file.block_count; i ++)
+		if (!is_pattern(file.blocks[i].pattern))
+			netstate_add(file.blocks[i].pattern);
+	default_firmware = file.firmware;
+	if (!default_firmware.image_path)
+		default_firmware = (struct firmware) {
+			.image_path = cmdline_image_path,
+			.version = cmdline_fw_version
+		};
+	image_path = default_firmware.image_path;
+	fw_version = default_firmware.version;
+	table_reset();
+}
+
 static int getnum() {
 	char *end;
 	long result = strtol(optarg, &end, 10);
@@ -45,11 +358,20 @@ static int getnum() {
 const char *image_path;
 const char *fw_version;
 const char *status_path;
+const char *shm_path;
+const char *control_path;
+const char *trace_path = "/var/run/smrtd.trace";
+const char *capture_path;
+int watch_interval = 10 * 1000;
+int reprobe_max = 5 * 60 * 1000;
+int upload_max = 4;
+int loop_budget = 20;
+bool chunk_probe;
 
 void configure(int argc, char *argv[]) {
 	int option;
 	int position = -1;
-	while ((option = getopt(argc, argv, "-i:c:f:v:hs:")) != -1) {
+	while ((option = getopt(argc, argv, "-i:c:f:v:hs:w:r:u:jm:C:T:l:b:P:F:")) != -1) {
 		switch(option) {
 			case 'i':
 				netstate_add(optarg);
@@ -94,6 +416,54 @@ void configure(int argc, char *argv[]) {
 			case 's':
 				status_path = optarg;
 				break;
+			case 'w':
+				watch_interval = getnum();
+				if (watch_interval <= 0)
+					die("The watch interval must be positive\n");
+				break;
+			case 'r':
+				reprobe_max = getnum();
+				if (reprobe_max <= 0)
+					die("The maximum re-probe interval must be positive\n");
+				break;
+			case 'u':
+				upload_max = getnum();
+				if (upload_max <= 0)
+					die("At least one upload must be allowed\n");
+				break;
+			case 'j':
+				chunk_probe = true;
+				break;
+			case 'm':
+				shm_path = optarg;
+				break;
+			case 'C':
+				control_path = optarg;
+				break;
+			case 'T':
+				trace_path = optarg;
+				break;
+			case 'P':
+				capture_path = optarg;
+				break;
+			case 'F':
+				file_path = optarg;
+				break;
+			case 'b':
+				loop_budget = getnum();
+				if (loop_budget <= 0)
+					die("The loop budget must be positive\n");
+				break;
+			case 'l':
+				if (strcmp(optarg, "error") == 0)
+					log_level = LL_ERROR;
+				else if (strcmp(optarg, "info") == 0)
+					log_level = LL_INFO;
+				else if (strcmp(optarg, "debug") == 0)
+					log_level = LL_DEBUG;
+				else
+					die("Unknown log level %s\n", optarg);
+				break;
 			case '?':
 			case 'h':
 				puts("Small Modem for Router Turris daemon\n");
@@ -102,6 +472,17 @@ void configure(int argc, char *argv[]) {
 				puts("-f <firmware_image>\n");
 				puts("-v <firmware_version>\n");
 				puts("-s <status_path>\n");
+				puts("-w <watch_interval_ms>\n");
+				puts("-r <max_reprobe_interval_ms>\n");
+				puts("-u <max_concurrent_uploads>\n");
+				puts("-j (probe larger firmware parts on jumbo frames)\n");
+				puts("-m <shared_status_path>\n");
+				puts("-C <control_socket_path>\n");
+				puts("-T <trace_dump_path>\n");
+				puts("-l error|info|debug\n");
+				puts("-b <loop_budget_ms>\n");
+				puts("-P <capture_directory>\n");
+				puts("-F <config_file>\n");
 				exit(1);
 		}
 	}
@@ -111,21 +492,119 @@ void configure(int argc, char *argv[]) {
 			if (!ifc->mappings[j].active)
 				die("Inactive connection %zu vlan %d on interface %s\n", j, ifc->mappings[j].vlan, ifc->name);
 	}
-	if (!image_path)
+	cmdline_image_path = image_path;
+	cmdline_fw_version = fw_version;
+	if (file_path) {
+		const char *error = config_file_read(file_path, &file);
+		if (error)
+			die("%s\n", error);
+	}
+	if (!image_path && !file.firmware.image_path)
 		die("The firmware image not set\n");
-	if (!fw_version)
+	if (!fw_version && !file.firmware.version)
 		die("The firmware version not set\n");
+	// Keep running with a broken image, the modems that need it wait until it's fixed
+	const char *error = config_file_images(&file);
+	if (error)
+		error_msg("%s\n", error);
+	// The command line interfaces are complete, the config file doesn't apply to them (except for the default firmware)
+	config_file_apply();
 	if (!status_path)
 		die("The status path must be set\n");
 }
 
-const struct conn_mapping *iface_conns(const char *iface) {
-	for (size_t i = 0; i < interface_count; i ++)
-		if (strcmp(interfaces[i].name, iface) == 0)
-			return interfaces[i].mappings;
+// Does the current configuration refer to the image file?
+static bool image_used(const char *path) {
+	if (strcmp(default_firmware.image_path, path) == 0)
+		return true;
+	for (size_t i = 0; i < file.block_count; i ++)
+		if (file.blocks[i].firmware.image_path && strcmp(file.blocks[i].firmware.image_path, path) == 0)
+			return true;
+	return false;
+}
+
+const char *configure_reload(void) {
+	if (!file_path)
+		return "No config file to reload";
+	struct config_file new_file;
+	const char *error = config_file_read(file_path, &new_file);
+	if (!error)
+		error = config_file_images(&new_file);
+	if (error) {
+		config_file_free(&new_file);
+		return error;
+	}
+	config_file_free(&file);
+	file = new_file;
+	config_file_apply();
+	image_prune(image_used);
+	msg("Reloaded config file %s\n", file_path);
 	return NULL;
 }
 
+// Find the interface, or put it together from all the blocks of the config file matching it
+static const struct interface *resolve(const char *iface) {
+	struct interface *interface = table_find(iface);
+	if (interface)
+		return interface;
+	struct slots slots = { .set = { false } };
+	struct firmware firmware = default_firmware;
+	bool matched = false;
+	for (size_t i = 0; i < file.block_count; i ++)
+		if (fnmatch(file.blocks[i].pattern, iface, 0) == 0) {
+			slots_apply(&slots, &file.blocks[i].slots);
+			if (file.blocks[i].firmware.image_path)
+				firmware = file.blocks[i].firmware;
+			matched = true;
+		}
+	if (!matched)
+		return NULL;
+	interface = malloc(sizeof *interface);
+	*interface = (struct interface) {
+		.name = strdup(iface),
+		.mapping_count = MAX_CONN_CNT,
+		.firmware = firmware,
+		.owned = true
+	};
+	for (size_t i = 0; i < MAX_CONN_CNT; i ++)
+		if (slots.set[i])
+			interface->mappings[i] = slots.mappings[i];
+	table_insert(interface);
+	return interface;
+}
+
+bool iface_forget(const char *iface) {
+	if (!table_size)
+		return false;
+	for (struct resolved **r = &table[name_hash(iface) & (table_size - 1)]; *r; r = &(*r)->next)
+		if (strcmp((*r)->interface->name, iface) == 0) {
+			struct resolved *found = *r;
+			if (!found->interface->owned)
+				return false;
+			*r = found->next;
+			free((char *)found->interface->name);
+			free(found->interface);
+			free(found);
+			table_count --;
+			break;
+		}
+	// The ones named in the config file stay watched, they may come back
+	for (size_t i = 0; i < file.block_count; i ++)
+		if (!is_pattern(file.blocks[i].pattern) && strcmp(file.blocks[i].pattern, iface) == 0)
+			return false;
+	return true;
+}
+
+const struct conn_mapping *iface_conns(const char *iface) {
+	const struct interface *interface = resolve(iface);
+	return interface ? interface->mappings : NULL;
+}
+
+const struct firmware *iface_firmware(const char *iface) {
+	const struct interface *interface = resolve(iface);
+	return interface ? &interface->firmware : NULL;
+}
+
 const char *interface_status_path(const char *interface) {
 	static char *path = NULL;
 	free(path);
@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define MAX_CONN_CNT 8
 
@@ -31,15 +32,68 @@ struct conn_mapping {
 	bool active;
 };
 
+/*
+ * The connection mappings of the interface (MAX_CONN_CNT of them), from the
+ * command line or from the matching blocks of the config file. NULL if the
+ * interface is not configured at all.
+ */
 const struct conn_mapping *iface_conns(const char *iface);
 
+/*
+ * The interface was deleted. Forget what was put together for it from the
+ * pattern blocks of the config file, it is resolved again if it comes back.
+ * Returns true if it is configured by patterns only, so there's no need to
+ * watch it any more.
+ */
+bool iface_forget(const char *iface);
+
+struct firmware {
+	const char *image_path;
+	const char *version;
+	// The image must have this CRC32 (if crc_set)
+	bool crc_set;
+	uint32_t crc;
+};
+
+/*
+ * The firmware for the interface, from the matching blocks of the config
+ * file or the default one. NULL if the interface is not configured.
+ */
+const struct firmware *iface_firmware(const char *iface);
+
 // Read the configuration passed on command line and set up everything
 void configure(int argc, char *argv[]);
+/*
+ * Read the config file again. The connection mappings and firmware of the
+ * interfaces change, the newly configured interfaces are watched. Returns
+ * the error (and keeps the old configuration) if the file is not valid or
+ * an image can't be read.
+ */
+const char *configure_reload(void);
 
+// The default firmware (of the interfaces without their own)
 extern const char *image_path;
 extern const char *fw_version;
 // Path where to put files describing status
 extern const char *status_path;
+// Path of the shared memory status region (NULL if not used)
+extern const char *shm_path;
+// Path of the control socket (NULL if not used)
+extern const char *control_path;
+// Where to dump the event trace on SIGUSR1
+extern const char *trace_path;
+// Directory for the captured frames (NULL if capturing is not possible)
+extern const char *capture_path;
+// How often to check a healthy line (ms)
+extern int watch_interval;
+// Maximum time between looking for a modem that is not present (ms)
+extern int reprobe_max;
+// How many firmware uploads may run at once (at most)
+extern int upload_max;
+// Longest acceptable iteration of the main loop (ms), longer ones are reported
+extern int loop_budget;
+// Try larger firmware image parts if the MTU allows
+extern bool chunk_probe;
 
 // What is the path to status file for given interface. The result is freed by the next call to this function.
 const char *interface_status_path(const char *interface);
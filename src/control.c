@@ -0,0 +1,191 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // accept4
+
+#include "control.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// The longest command we accept
+#define COMMAND_MAX 1024
+// Maximum number of arguments of a command
+#define ARGS_MAX 256
+
+struct control_client {
+	int fd;
+	char input[COMMAND_MAX];
+	size_t input_len;
+	char *output;
+	size_t output_len, output_sent, output_cap;
+};
+
+static int listener = -1;
+static const char *socket_path;
+static control_hook command_hook;
+
+int control_init(const char *path, control_hook hook) {
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX
+	};
+	if (strlen(path) >= sizeof addr.sun_path)
+		die("Control socket path %s is too long\n", path);
+	strcpy(addr.sun_path, path);
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener == -1)
+		die("Couldn't create control socket: %s\n", strerror(errno));
+	// A leftover from previous run would prevent the bind
+	if (unlink(path) == -1 && errno != ENOENT)
+		die("Couldn't remove old control socket %s: %s\n", path, strerror(errno));
+	if (bind(listener, (struct sockaddr *)&addr, sizeof addr) == -1)
+		die("Couldn't bind control socket to %s: %s\n", path, strerror(errno));
+	if (listen(listener, 16) == -1)
+		die("Couldn't listen on control socket %s: %s\n", path, strerror(errno));
+	socket_path = path;
+	command_hook = hook;
+	return listener;
+}
+
+void control_cleanup(void) {
+	if (listener == -1)
+		return;
+	close(listener);
+	listener = -1;
+	if (unlink(socket_path) == -1)
+		error_msg("Couldn't remove control socket %s: %s\n", socket_path, strerror(errno));
+}
+
+struct control_client *control_accept(int *fd) {
+	int client_fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+			return NULL;
+		die("Couldn't accept control connection: %s\n", strerror(errno));
+	}
+	struct control_client *client = malloc(sizeof *client);
+	*client = (struct control_client) {
+		.fd = client_fd
+	};
+	*fd = client_fd;
+	return client;
+}
+
+void control_release(struct control_client *client) {
+	if (close(client->fd) == -1)
+		error_msg("Error closing control connection %d: %s\n", client->fd, strerror(errno));
+	free(client->output);
+	free(client);
+}
+
+void control_printf(struct control_client *client, const char *format, ...) {
+	for (;;) {
+		va_list args;
+		va_start(args, format);
+		size_t space = client->output_cap - client->output_len;
+		int result = vsnprintf(client->output + client->output_len, space, format, args);
+		va_end(args);
+		assert(result >= 0);
+		if ((size_t)result < space) {
+			client->output_len += result;
+			return;
+		}
+		// Didn't fit, make more space and try again
+		client->output_cap = 2 * client->output_cap + result + 1;
+		client->output = realloc(client->output, client->output_cap);
+	}
+}
+
+static void execute(struct control_client *client, char *line) {
+	char *argv[ARGS_MAX];
+	size_t argc = 0;
+	char *saveptr;
+	for (char *word = strtok_r(line, " \t\r", &saveptr); word; word = strtok_r(NULL, " \t\r", &saveptr)) {
+		if (argc == ARGS_MAX) {
+			control_printf(client, "error Too many arguments\n");
+			return;
+		}
+		argv[argc ++] = word;
+	}
+	if (!argc) {
+		control_printf(client, "error Empty command\n");
+		return;
+	}
+	dbg("Control command %s with %zu arguments\n", argv[0], argc - 1);
+	command_hook(client, argv[0], argc - 1, argv + 1);
+}
+
+static enum control_wait client_read(struct control_client *client) {
+	ssize_t received = recv(client->fd, client->input + client->input_len, COMMAND_MAX - client->input_len, 0);
+	if (received == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return CW_READ;
+		error_msg("Error reading control connection: %s\n", strerror(errno));
+		return CW_CLOSE;
+	}
+	if (received == 0)
+		return CW_CLOSE; // Closed before sending the whole command
+	client->input_len += received;
+	char *end = memchr(client->input, '\n', client->input_len);
+	if (!end) {
+		if (client->input_len == COMMAND_MAX) {
+			msg("Too long control command\n");
+			return CW_CLOSE;
+		}
+		return CW_READ; // Not complete yet
+	}
+	*end = '\0';
+	execute(client, client->input);
+	return CW_WRITE;
+}
+
+static enum control_wait client_write(struct control_client *client) {
+	while (client->output_sent < client->output_len) {
+		ssize_t sent = send(client->fd, client->output + client->output_sent, client->output_len - client->output_sent, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return CW_WRITE; // Wait for more space in the socket
+			if (errno == EINTR)
+				continue;
+			error_msg("Error writing control connection: %s\n", strerror(errno));
+			return CW_CLOSE;
+		}
+		client->output_sent += sent;
+	}
+	return CW_CLOSE;
+}
+
+enum control_wait control_ready(struct control_client *client) {
+	if (client->output)
+		return client_write(client);
+	enum control_wait result = client_read(client);
+	if (result == CW_WRITE) {
+		if (!client->output)
+			control_printf(client, "%s", ""); // Make sure there's something, even if empty
+		// Try writing right away, usually it fits into the socket
+		return client_write(client);
+	}
+	return result;
+}
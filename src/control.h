@@ -0,0 +1,54 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_CONTROL_H
+#define SMRT_CONTROL_H
+
+#include <stdlib.h>
+
+/*
+ * The control socket. Each client sends one command on a line (the command
+ * name followed by space-separated arguments), gets the answer and the
+ * connection is closed.
+ */
+
+struct control_client;
+
+// What the client waits for now
+enum control_wait {
+	CW_READ,
+	CW_WRITE,
+	CW_CLOSE
+};
+
+// A command arrived. Answer it with control_printf.
+typedef void (*control_hook)(struct control_client *client, const char *command, size_t argc, char *argv[]);
+
+// Create the listening socket at given path and return its file descriptor.
+int control_init(const char *path, control_hook hook);
+// Remove the socket
+void control_cleanup(void);
+// A new client is waiting on the listening socket. Accept it. NULL if there's none after all.
+struct control_client *control_accept(int *fd);
+// The client's socket is ready for what the client waits for. Handle it and return what it waits for next.
+enum control_wait control_ready(struct control_client *client);
+void control_release(struct control_client *client);
+// Append to the answer.
+void control_printf(struct control_client *client, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,96 @@
+#!/bin/sh
+
+# SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+# Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Run the daemon against emulated modems under various faults and report
+# how long the lines took to get online. Needs root (it creates veth pairs).
+#
+# Usage: emu-scenarios.sh [modems] [seconds] [scenario...]
+#
+# The binaries are taken from the directory of this script, or from $BIN.
+
+set -e
+
+MODEMS=${1:-20}
+DURATION=${2:-60}
+[ $# -gt 2 ] && shift 2 && ONLY="$*"
+BIN=${BIN:-$(dirname "$0")}
+WORK=$(mktemp -d)
+VERSION=emu-scenario
+SEED=${SEED:-1}
+
+# name|emulator arguments
+# (the stuck-training one needs more than 10 minutes, the daemon waits for the training for long)
+SCENARIOS='
+baseline|
+lossy-upload|-f drop:img_data:0.05 -f drop:img_ack:0.05
+lossy-all|-f drop:all:0.1
+jitter|-f delay:all:0.3:80 -f reorder:all:0.05 -f dup:all:0.05
+duplicates|-f dup:all:0.1
+lost-link-ack|-f drop:param_ack:0.4
+refused-offer|-x refuse-offer=1
+wrong-version|-x wrong-version=1
+stuck-training|-x stuck-training=1 -t 2000
+'
+
+cleanup() {
+	i=0
+	while [ $i -lt $MODEMS ] ; do
+		ip link del sd$i 2>/dev/null || true
+		i=$((i + 1))
+	done
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+i=0
+DAEMON_IFACES=
+EMU_IFACES=
+while [ $i -lt $MODEMS ] ; do
+	ip link add sd$i type veth peer name sm$i
+	ip link set sd$i up
+	ip link set sm$i up
+	DAEMON_IFACES="$DAEMON_IFACES -i sd$i"
+	EMU_IFACES="$EMU_IFACES sm$i"
+	i=$((i + 1))
+done
+head -c 200000 /dev/urandom >"$WORK/image"
+mkdir "$WORK/status"
+
+printf '%-16s %8s %8s %8s %8s %8s %8s\n' scenario online min p50 p90 p99 max
+echo "$SCENARIOS" | while IFS='|' read NAME ARGS ; do
+	[ -z "$NAME" ] && continue
+	if [ -n "$ONLY" ] ; then
+		case " $ONLY " in
+			*" $NAME "*) ;;
+			*) continue ;;
+		esac
+	fi
+	"$BIN/smrt-emu" -s $SEED -v $VERSION -H 300 -t 1000 $ARGS $EMU_IFACES >"$WORK/$NAME.emu" 2>&1 &
+	EMU=$!
+	"$BIN/smrtd" $DAEMON_IFACES -f "$WORK/image" -v $VERSION -s "$WORK/status" -l error 2>"$WORK/$NAME.daemon" &
+	DAEMON=$!
+	sleep $DURATION
+	kill $DAEMON
+	kill $EMU
+	wait $EMU || true
+	wait $DAEMON || true
+	grep '^result' "$WORK/$NAME.emu" | sed -e 's/[a-z0-9]*=//g' | {
+		read RESULT MODEM_COUNT ONLINE MIN P50 P90 P99 MAX
+		printf '%-16s %8s %8s %8s %8s %8s %8s\n' "$NAME" "$ONLINE/$MODEM_COUNT" "$MIN" "$P50" "$P90" "$P99" "$MAX"
+	}
+done
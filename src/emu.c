@@ -0,0 +1,311 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Emulator of the modems. It answers the daemon on the other ends of veth
+ * pairs (or TAP devices), one modem for each interface given. Faults may be
+ * injected into the frames in both directions.
+ */
+
+#include "modem.h"
+#include "fault.h"
+#include "proto_const.h"
+#include "util.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+static const uint8_t modem_mac[ETH_ALEN] = { 6, 5, 4, 3, 2, 1 };
+
+struct pending;
+
+struct emu_modem {
+	const char *name;
+	int ifindex;
+	struct modem modem;
+	struct fault_rng rng;
+	// The MAC address of the daemon's side
+	uint8_t peer[ETH_ALEN];
+	// A frame in each direction waiting to be overtaken (reordered)
+	struct fault_hold held[2];
+};
+
+// A frame waiting to be delivered
+struct pending {
+	uint64_t due;
+	struct emu_modem *modem;
+	// To the modem (or to the daemon)
+	bool input;
+	size_t size;
+	struct pending *next;
+	uint8_t data[];
+};
+
+static struct emu_modem *modems;
+static size_t modem_count;
+static int sock = -1;
+// Sorted by the due time, the ones with the same time in the order they were scheduled
+static struct pending *queue;
+
+static volatile sig_atomic_t terminate;
+
+static void terminate_signal(int unused) {
+	(void)unused;
+	terminate = 1;
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		die("Couldn't get time: %s\n", strerror(errno));
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int modem_cmp(const void *a, const void *b) {
+	const struct emu_modem *ma = a, *mb = b;
+	return (ma->ifindex > mb->ifindex) - (ma->ifindex < mb->ifindex);
+}
+
+static struct emu_modem *modem_find(int ifindex) {
+	const struct emu_modem key = {
+		.ifindex = ifindex
+	};
+	return bsearch(&key, modems, modem_count, sizeof *modems, modem_cmp);
+}
+
+static void schedule(struct pending *p) {
+	struct pending **pos = &queue;
+	while (*pos && (*pos)->due <= p->due)
+		pos = &(*pos)->next;
+	p->next = *pos;
+	*pos = p;
+}
+
+static void unschedule(struct pending *p) {
+	struct pending **pos = &queue;
+	while (*pos != p)
+		pos = &(*pos)->next;
+	*pos = p->next;
+}
+
+static void send_frame(struct emu_modem *m, const uint8_t *data, size_t size) {
+	uint8_t frame[sizeof(struct ethhdr) + MODEM_ANSWER_MAX];
+	struct ethhdr *hdr = (struct ethhdr *)frame;
+	memcpy(hdr->h_dest, m->peer, ETH_ALEN);
+	memcpy(hdr->h_source, modem_mac, ETH_ALEN);
+	hdr->h_proto = htons(CONTROL_PROTOCOL);
+	memcpy(frame + sizeof *hdr, data, size);
+	struct sockaddr_ll to = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(CONTROL_PROTOCOL),
+		.sll_ifindex = m->ifindex
+	};
+	if (sendto(sock, frame, sizeof *hdr + size, 0, (struct sockaddr *)&to, sizeof to) == -1)
+		error_msg("Couldn't send answer on %s: %s\n", m->name, strerror(errno));
+}
+
+static void transmit(struct emu_modem *m, uint64_t now, bool input, const uint8_t *data, size_t size);
+
+static void deliver(struct emu_modem *m, uint64_t now, bool input, const uint8_t *data, size_t size) {
+	if (!input) {
+		send_frame(m, data, size);
+		return;
+	}
+	uint8_t answer[MODEM_ANSWER_MAX];
+	size_t answer_size = modem_input(&m->modem, now, data, size, answer);
+	dbg("%s: frame %hhu of size %zu, answer of size %zu\n", m->name, data[0], size, answer_size);
+	if (answer_size)
+		transmit(m, now, false, answer, answer_size);
+}
+
+// Pass a frame through the faults
+static void transmit(struct emu_modem *m, uint64_t now, bool input, const uint8_t *data, size_t size) {
+	struct fault_hold *hold = &m->held[input];
+	struct fault_plan plan = fault_plan(&m->rng, hold, now, data[0]);
+	if (!plan.copies) {
+		dbg("%s: dropping frame %hhu\n", m->name, data[0]);
+		return;
+	}
+	if (plan.copies == 1 && plan.due[0] == now && plan.hold == -1 && plan.overtaken_by == -1) {
+		// The usual case, no need to queue anything
+		deliver(m, now, input, data, size);
+		return;
+	}
+	for (unsigned copy = 0; copy < plan.copies; copy ++) {
+		struct pending *p = malloc(sizeof *p + size);
+		*p = (struct pending) {
+			.due = plan.due[copy],
+			.modem = m,
+			.input = input,
+			.size = size
+		};
+		memcpy(p->data, data, size);
+		schedule(p);
+		if ((int)copy == plan.hold)
+			hold->frame = p;
+		if ((int)copy == plan.overtaken_by) {
+			// The held frame follows right after this one
+			struct pending *overtaken = plan.overtaken;
+			unschedule(overtaken);
+			overtaken->due = plan.overtaken_due;
+			schedule(overtaken);
+		}
+	}
+}
+
+static void run_queue(uint64_t now) {
+	while (queue && queue->due <= now) {
+		struct pending *p = queue;
+		queue = p->next;
+		if (p->modem->held[p->input].frame == p)
+			p->modem->held[p->input].frame = NULL;
+		deliver(p->modem, now, p->input, p->data, p->size);
+		free(p);
+	}
+}
+
+static void receive(uint64_t now) {
+	for (;;) {
+		uint8_t frame[ETH_FRAME_LEN + MAX_JUMBO_PAYLOAD];
+		struct sockaddr_ll from;
+		socklen_t from_len = sizeof from;
+		ssize_t received = recvfrom(sock, frame, sizeof frame, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+		if (received == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			die("Error receiving frame: %s\n", strerror(errno));
+		}
+		if (from.sll_pkttype == PACKET_OUTGOING || (size_t)received <= sizeof(struct ethhdr))
+			continue;
+		struct ethhdr *hdr = (struct ethhdr *)frame;
+		// Only the frames for the modem, not the answers of another emulated modem seen on the daemon's side
+		if (memcmp(hdr->h_dest, modem_mac, ETH_ALEN) != 0)
+			continue;
+		struct emu_modem *m = modem_find(from.sll_ifindex);
+		if (!m)
+			continue;
+		memcpy(m->peer, hdr->h_source, ETH_ALEN);
+		transmit(m, now, true, frame + sizeof *hdr, received - sizeof *hdr);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-v version] " MODEM_USAGE " [-d] interface...\n", name);
+	exit(1);
+}
+
+static void summary(void) {
+	uint64_t now = now_ms();
+	uint64_t *times = malloc(modem_count * sizeof *times);
+	size_t online = 0;
+	for (size_t i = 0; i < modem_count; i ++) {
+		const struct emu_modem *m = &modems[i];
+		enum modem_line_state state = modem_line_state(&m->modem, now);
+		printf("%s: phase %d line %d offers %u uploads %u resets %u", m->name, (int)m->modem.phase, (int)state, m->modem.offers, m->modem.uploads, m->modem.resets);
+		if (m->modem.online_at) {
+			times[online ++] = m->modem.online_at - m->modem.first_seen;
+			printf(" online after %llu ms", (unsigned long long)times[online - 1]);
+		}
+		putchar('\n');
+	}
+	modem_result(modem_count, times, online);
+	free(times);
+}
+
+int main(int argc, char *argv[]) {
+	struct modem_config config = modem_config_default;
+	uint64_t seed = 1;
+	int option;
+	while ((option = getopt(argc, argv, "v:d" MODEM_OPTIONS)) != -1) {
+		switch (option) {
+			case 'v':
+				config.version = optarg;
+				break;
+			case 'd':
+				log_level = LL_DEBUG;
+				break;
+			default:
+				if (!modem_option(option, optarg, &config, &seed))
+					usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+	// One socket for all the interfaces, there may be hundreds of them
+	sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(CONTROL_PROTOCOL));
+	if (sock == -1)
+		die("Couldn't create AF_PACKET socket: %s\n", strerror(errno));
+	modem_count = argc - optind;
+	modems = calloc(modem_count, sizeof *modems);
+	uint64_t now = now_ms();
+	for (size_t i = 0; i < modem_count; i ++) {
+		struct emu_modem *m = &modems[i];
+		m->name = argv[optind + i];
+		m->ifindex = if_nametoindex(m->name);
+		if (!m->ifindex)
+			die("Interface %s doesn't exist: %s\n", m->name, strerror(errno));
+		modem_init(&m->modem, &config, now);
+		// Each modem has its own faults, independent of the timing of the others
+		fault_rng_init(&m->rng, seed, i);
+		// The frames are sent to the modem's MAC, not to the interface's one
+		struct packet_mreq mreq = {
+			.mr_ifindex = m->ifindex,
+			.mr_type = PACKET_MR_PROMISC
+		};
+		if (setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1)
+			die("Couldn't make %s promiscuous: %s\n", m->name, strerror(errno));
+	}
+	qsort(modems, modem_count, sizeof *modems, modem_cmp);
+	struct sigaction action = {
+		.sa_handler = terminate_signal
+	};
+	if (sigaction(SIGINT, &action, NULL) == -1 || sigaction(SIGTERM, &action, NULL) == -1)
+		die("Couldn't set signals: %s\n", strerror(errno));
+	msg("Emulating %zu modems\n", modem_count);
+	while (!terminate) {
+		now = now_ms();
+		int timeout = -1;
+		if (queue)
+			timeout = queue->due > now ? queue->due - now : 0;
+		struct pollfd pfd = {
+			.fd = sock,
+			.events = POLLIN
+		};
+		if (poll(&pfd, 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Error waiting for frames: %s\n", strerror(errno));
+		}
+		now = now_ms();
+		run_queue(now);
+		if (pfd.revents & POLLIN)
+			receive(now);
+	}
+	summary();
+	return 0;
+}
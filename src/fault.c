@@ -0,0 +1,140 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fault.h"
+#include "proto_const.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum fault_kind {
+	FK_DROP,
+	FK_DUP,
+	FK_DELAY,
+	FK_REORDER,
+	FK_COUNT
+};
+
+static const char *const kind_names[] = {
+	[FK_DROP] = "drop",
+	[FK_DUP] = "dup",
+	[FK_DELAY] = "delay",
+	[FK_REORDER] = "reorder"
+};
+
+static const char *const message_names[] = {
+	[CMD_OFFER_IMAGE] = "offer_image",
+	[CMD_IMG_DATA] = "img_data",
+	[CMD_IMG_ACK] = "img_ack",
+	[CMD_GET_PARAM] = "get_param",
+	[CMD_ANSWER_PARAM] = "answer_param",
+	[CMD_SET_PARAM] = "set_param",
+	[CMD_PARAM_ACK] = "param_ack"
+};
+
+#define MESSAGE_COUNT (sizeof message_names / sizeof *message_names)
+
+static struct {
+	// Probabilities scaled to 2^32
+	uint64_t probability[FK_COUNT];
+	unsigned delay_max;
+} rules[MESSAGE_COUNT];
+
+// splitmix64, good enough and tiny
+static uint64_t next(struct fault_rng *rng) {
+	uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+void fault_rng_init(struct fault_rng *rng, uint64_t seed, uint64_t stream) {
+	rng->state = seed;
+	rng->state = next(rng) ^ (stream * 0xD1B54A32D192ED03ULL);
+}
+
+static bool happens(struct fault_rng *rng, uint64_t probability) {
+	// Don't consume a number if there's no chance, so adding a rule for one message doesn't change the others
+	return probability && (next(rng) >> 32) < probability;
+}
+
+bool fault_rule(const char *spec) {
+	char kind[16], message[16];
+	double probability;
+	unsigned delay = 0;
+	int fields = sscanf(spec, "%15[^:]:%15[^:]:%lf:%u", kind, message, &probability, &delay);
+	if (fields < 3 || probability < 0 || probability > 1)
+		return false;
+	size_t k;
+	for (k = 0; k < FK_COUNT; k ++)
+		if (strcmp(kind, kind_names[k]) == 0)
+			break;
+	if (k == FK_COUNT)
+		return false;
+	if (k == FK_DELAY && !delay)
+		return false;
+	bool all = strcmp(message, "all") == 0, found = false;
+	for (size_t m = 0; m < MESSAGE_COUNT; m ++)
+		if (message_names[m] && (all || strcmp(message, message_names[m]) == 0)) {
+			rules[m].probability[k] = probability * 4294967296.0;
+			if (k == FK_DELAY)
+				rules[m].delay_max = delay;
+			found = true;
+		}
+	return found;
+}
+
+struct fault_plan fault_plan(struct fault_rng *rng, struct fault_hold *hold, uint64_t at, uint8_t cmd) {
+	struct fault_plan plan = {
+		.copies = 1,
+		.due = { at, at },
+		.hold = -1,
+		.overtaken_by = -1
+	};
+	if (cmd >= MESSAGE_COUNT)
+		return plan;
+	const uint64_t *p = rules[cmd].probability;
+	bool drop = happens(rng, p[FK_DROP]);
+	bool duplicate = happens(rng, p[FK_DUP]);
+	bool reorder = happens(rng, p[FK_REORDER]);
+	if (happens(rng, p[FK_DELAY]))
+		plan.due[0] = plan.due[1] = at + next(rng) % (rules[cmd].delay_max + 1);
+	if (drop) {
+		plan.copies = 0;
+		return plan;
+	}
+	plan.copies = 1 + duplicate;
+	for (unsigned copy = 0; copy < plan.copies; copy ++)
+		if (reorder && !copy && !hold->frame) {
+			plan.due[0] = at + FAULT_REORDER_WINDOW;
+			plan.hold = 0;
+		} else if (plan.hold == 0) {
+			// The duplicate overtakes its own held copy, the same frame. Deliver them together.
+			plan.due[0] = plan.due[1];
+			plan.hold = -1;
+		} else if (hold->frame && hold->due > plan.due[copy]) {
+			plan.overtaken_by = copy;
+			plan.overtaken = hold->frame;
+			plan.overtaken_due = plan.due[copy];
+			hold->frame = NULL;
+		}
+	if (plan.hold == 0)
+		hold->due = plan.due[0];
+	return plan;
+}
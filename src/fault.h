@@ -0,0 +1,80 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_FAULT_H
+#define SMRT_FAULT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Faults injected by the emulator into the frames between the daemon and the
+ * modems. Each kind of message (by its command) has its own probabilities.
+ * The decisions come from a seeded generator, so a run can be repeated.
+ */
+
+// A generator of pseudo-random numbers (one for each modem, so they don't influence each other)
+struct fault_rng {
+	uint64_t state;
+};
+
+void fault_rng_init(struct fault_rng *rng, uint64_t seed, uint64_t stream);
+
+// How long a frame waits to be overtaken when reordered (ms)
+#define FAULT_REORDER_WINDOW 100
+
+/*
+ * The frame held back to be overtaken (reordered), one for each direction of
+ * each link. The frame itself belongs to the caller, which stores it here
+ * when told to by the plan and clears it when the frame gets delivered.
+ */
+struct fault_hold {
+	void *frame;
+	uint64_t due;
+};
+
+/*
+ * When to deliver the copies of a frame. A frame is dropped (no copies),
+ * delivered once or duplicated, delayed and possibly held back, so a later
+ * frame overtakes it.
+ */
+struct fault_plan {
+	unsigned copies;
+	uint64_t due[2];
+	// The copy to be stored into the hold (-1 if none)
+	int hold;
+	/*
+	 * The frame held before gets overtaken by this copy (-1 if none). Once the
+	 * copy is scheduled, the held frame is to be delivered right after it, at
+	 * overtaken_due. The hold is empty then.
+	 */
+	int overtaken_by;
+	void *overtaken;
+	uint64_t overtaken_due;
+};
+
+/*
+ * Add a rule. The format is <kind>:<message>:<probability>[:<max_delay_ms>],
+ * where the kind is drop, dup, delay or reorder and the message is a command
+ * name (like img_ack) or all. Returns false if it can't be parsed.
+ */
+bool fault_rule(const char *spec);
+// Decide what happens to a frame with the command, sent at the given time (already including the latency of the wire)
+struct fault_plan fault_plan(struct fault_rng *rng, struct fault_hold *hold, uint64_t at, uint8_t cmd);
+
+#endif
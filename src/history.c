@@ -0,0 +1,191 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "history.h"
+#include "status.h"
+#include "control.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+struct sample {
+	uint64_t time;
+	uint32_t dscur, uscur;
+	uint32_t dsmax, usmax;
+	uint16_t dspower, uspower;
+	// The line state for raw samples, number of samples in the average for the others
+	uint16_t state_or_count;
+};
+
+struct ring {
+	struct sample *samples;
+	size_t size, pos, count;
+};
+
+struct history {
+	struct ring raw, minutes;
+	// When the latest raw sample started to be collected
+	uint64_t raw_step_start;
+	// The minute being accumulated now
+	uint64_t minute;
+	uint64_t sum_dscur, sum_uscur, sum_dsmax, sum_usmax, sum_dspower, sum_uspower;
+	uint16_t sum_count;
+	// While suspended: name of the interface and the next suspended history
+	char *ifname;
+	struct history *next;
+	// Storage for both the rings, allocated in one piece
+	struct sample storage[HISTORY_RAW + HISTORY_MINUTES];
+};
+
+struct history *history_alloc(void) {
+	struct history *history = malloc(sizeof *history);
+	if (!history)
+		die("Couldn't allocate history: %s\n", strerror(errno));
+	*history = (struct history) {
+		.raw = {
+			.samples = history->storage,
+			.size = HISTORY_RAW
+		},
+		.minutes = {
+			.samples = history->storage + HISTORY_RAW,
+			.size = HISTORY_MINUTES
+		}
+	};
+	return history;
+}
+
+void history_destroy(struct history *history) {
+	free(history);
+}
+
+static struct history *suspended;
+
+struct history *history_resume(const char *ifname, uint64_t now) {
+	struct history *result = NULL;
+	for (struct history **h = &suspended; *h;) {
+		struct history *history = *h;
+		bool stale = (history->minute + 1) * HISTORY_MINUTE + HISTORY_MINUTES * HISTORY_MINUTE <= now;
+		bool match = strcmp(history->ifname, ifname) == 0;
+		if (match || stale) {
+			*h = history->next;
+			free(history->ifname);
+			history->ifname = NULL;
+			history->next = NULL;
+			if (match && !stale)
+				result = history;
+			else
+				history_destroy(history);
+		} else
+			h = &history->next;
+	}
+	return result ? result : history_alloc();
+}
+
+void history_suspend(struct history *history, const char *ifname) {
+	if (!history->raw.count) {
+		// Nothing to keep
+		history_destroy(history);
+		return;
+	}
+	history->ifname = strdup(ifname);
+	history->next = suspended;
+	suspended = history;
+}
+
+static struct sample *ring_latest(struct ring *ring) {
+	if (!ring->count)
+		return NULL;
+	return &ring->samples[(ring->pos + ring->size - 1) % ring->size];
+}
+
+static void ring_push(struct ring *ring, const struct sample *sample) {
+	ring->samples[ring->pos] = *sample;
+	ring->pos = (ring->pos + 1) % ring->size;
+	if (ring->count < ring->size)
+		ring->count ++;
+}
+
+// Close the minute being accumulated and store its average
+static void flush_minute(struct history *history) {
+	if (!history->sum_count)
+		return;
+	uint16_t c = history->sum_count;
+	const struct sample average = {
+		.time = history->minute * HISTORY_MINUTE,
+		.dscur = history->sum_dscur / c,
+		.uscur = history->sum_uscur / c,
+		.dsmax = history->sum_dsmax / c,
+		.usmax = history->sum_usmax / c,
+		.dspower = history->sum_dspower / c,
+		.uspower = history->sum_uspower / c,
+		.state_or_count = c
+	};
+	ring_push(&history->minutes, &average);
+	history->sum_dscur = history->sum_uscur = history->sum_dsmax = history->sum_usmax = history->sum_dspower = history->sum_uspower = 0;
+	history->sum_count = 0;
+}
+
+void history_add(struct history *history, const struct line_report *report, uint64_t now) {
+	const struct sample sample = {
+		.time = now,
+		.dscur = report->dscur,
+		.uscur = report->uscur,
+		.dsmax = report->dsmax,
+		.usmax = report->usmax,
+		.dspower = report->dspower,
+		.uspower = report->uspower,
+		.state_or_count = report->state
+	};
+	// Samples coming within one step replace each other, so the ring covers the whole hour even when the modem is asked often
+	struct sample *latest = ring_latest(&history->raw);
+	if (latest && now - history->raw_step_start < HISTORY_RAW_STEP)
+		*latest = sample;
+	else {
+		ring_push(&history->raw, &sample);
+		history->raw_step_start = now;
+	}
+	uint64_t minute = now / HISTORY_MINUTE;
+	if (minute != history->minute) {
+		flush_minute(history);
+		history->minute = minute;
+	}
+	history->sum_dscur += sample.dscur;
+	history->sum_uscur += sample.uscur;
+	history->sum_dsmax += sample.dsmax;
+	history->sum_usmax += sample.usmax;
+	history->sum_dspower += sample.dspower;
+	history->sum_uspower += sample.uspower;
+	history->sum_count ++;
+}
+
+static void ring_dump(const struct ring *ring, const char *kind, int64_t offset, struct control_client *client) {
+	for (size_t i = 0; i < ring->count; i ++) {
+		const struct sample *s = &ring->samples[(ring->pos + ring->size - ring->count + i) % ring->size];
+		control_printf(client, "%s %lld %u %u %u %u %u %u %u\n", kind, (long long)((int64_t)(s->time / 1000) + offset), (unsigned)s->state_or_count, (unsigned)s->dscur, (unsigned)s->uscur, (unsigned)s->dsmax, (unsigned)s->usmax, (unsigned)s->dspower, (unsigned)s->uspower);
+	}
+}
+
+void history_dump(const struct history *history, uint64_t now, struct control_client *client) {
+	// The samples are in monotonic time, convert them to the wall clock
+	int64_t offset = (int64_t)time(NULL) - (int64_t)(now / 1000);
+	ring_dump(&history->raw, "raw", offset, client);
+	ring_dump(&history->minutes, "minute", offset, client);
+}
@@ -0,0 +1,53 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_HISTORY_H
+#define SMRT_HISTORY_H
+
+#include <stdint.h>
+
+/*
+ * History of the line statistics. There are two rings of fixed size, one
+ * with the samples as they come (at most one per HISTORY_RAW_STEP) for the
+ * last hour and one with averages over each minute for the last day.
+ */
+#define HISTORY_RAW_STEP (10 * 1000)
+#define HISTORY_RAW (60 * 60 * 1000 / HISTORY_RAW_STEP)
+#define HISTORY_MINUTE (60 * 1000)
+#define HISTORY_MINUTES (24 * 60)
+
+struct history;
+struct line_report;
+struct control_client;
+
+struct history *history_alloc(void);
+void history_destroy(struct history *history);
+/*
+ * The history of an interface survives the interface going down and up again
+ * (eg. the link flapping): it is suspended and the interface of the same name
+ * resumes it. A suspended history is dropped once all its samples are older
+ * than a day.
+ */
+struct history *history_resume(const char *ifname, uint64_t now);
+void history_suspend(struct history *history, const char *ifname);
+// Store another status reported by the modem
+void history_add(struct history *history, const struct line_report *report, uint64_t now);
+// Write the whole history into the control answer
+void history_dump(const struct history *history, uint64_t now, struct control_client *client);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "image.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// The largest image accepted (after decompression). Firmware is much smaller, this stops a broken or malicious file.
+#define IMAGE_MAX (64 << 20)
+
+// An image file and how it looked like when it was read
+struct image_file {
+	char *path;
+	struct stat st;
+	struct image *image;
+	// The problem logged last time (NULL if none)
+	char *reported;
+	struct image_file *next;
+};
+
+static struct image *images;
+static struct image_file *files;
+
+static uint32_t crc_table[8][256];
+
+static void crc_init(void) {
+	for (unsigned i = 0; i < 256; i ++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit ++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+	// Each next table is the CRC of the byte followed by one more zero byte
+	for (unsigned i = 0; i < 256; i ++)
+		for (int t = 1; t < 8; t ++)
+			crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+}
+
+/*
+ * CRC32 (the one of ethernet and zlib). It goes by 8 bytes at a time
+ * (slicing-by-8), which is several times faster than one byte at a time.
+ * The words are put together from bytes, so it works on both endians.
+ */
+static uint32_t checksum(const uint8_t *data, size_t size) {
+	if (!crc_table[0][1])
+		crc_init();
+	uint32_t crc = 0xFFFFFFFF;
+	for (; size >= 8; size -= 8, data += 8) {
+		uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+		uint32_t high = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = crc_table[7][low & 0xFF] ^ crc_table[6][(low >> 8) & 0xFF] ^ crc_table[5][(low >> 16) & 0xFF] ^ crc_table[4][low >> 24] ^
+			crc_table[3][high & 0xFF] ^ crc_table[2][(high >> 8) & 0xFF] ^ crc_table[1][(high >> 16) & 0xFF] ^ crc_table[0][high >> 24];
+	}
+	for (; size; size --, data ++)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *data) & 0xFF];
+	return ~crc;
+}
+
+// Can an image of this size be uploaded at all?
+static const char *size_problem(size_t size) {
+	static char buffer[64];
+	if (!size)
+		return "The image is empty";
+	if (size > UINT32_MAX)
+		return "The image is too large";
+	// The modem freezes on image parts not divisible by 4 and the last part is what remains
+	if (size % 4) {
+		snprintf(buffer, sizeof buffer, "The size %zu is not a multiple of 4", size);
+		return buffer;
+	}
+	return NULL;
+}
+
+// Was the file replaced or modified since it was read?
+static bool file_changed(const struct stat *old, const struct stat *new) {
+	return old->st_dev != new->st_dev || old->st_ino != new->st_ino || old->st_size != new->st_size || old->st_mtim.tv_sec != new->st_mtim.tv_sec || old->st_mtim.tv_nsec != new->st_mtim.tv_nsec || old->st_ctim.tv_sec != new->st_ctim.tv_sec || old->st_ctim.tv_nsec != new->st_ctim.tv_nsec;
+}
+
+// The buffer the image is read (and decompressed) into
+struct buffer {
+	uint8_t *data;
+	size_t size, capacity;
+};
+
+// Make room for more data at the end
+static bool buffer_grow(struct buffer *buffer, size_t hint) {
+	if (buffer->size < buffer->capacity)
+		return true;
+	if (buffer->capacity >= IMAGE_MAX)
+		return false;
+	buffer->capacity = buffer->capacity ? 2 * buffer->capacity : hint;
+	if (buffer->capacity > IMAGE_MAX)
+		buffer->capacity = IMAGE_MAX;
+	buffer->data = realloc(buffer->data, buffer->capacity);
+	return true;
+}
+
+/*
+ * Decompress the next piece of input into the buffer. Returns the zlib
+ * result, Z_OK or Z_STREAM_END if all is fine (Z_MEM_ERROR if the
+ * buffer can't grow any more).
+ */
+static int inflate_chunk(z_stream *z, struct buffer *out, uint8_t *in, size_t in_size, size_t hint) {
+	z->next_in = in;
+	z->avail_in = in_size;
+	int result;
+	do {
+		uint8_t spare;
+		bool full = !buffer_grow(out, hint);
+		if (full) {
+			// The buffer is as large as allowed, the image is too large only if there's more output
+			z->next_out = &spare;
+			z->avail_out = 1;
+		} else {
+			z->next_out = out->data + out->size;
+			z->avail_out = out->capacity - out->size;
+		}
+		result = inflate(z, Z_NO_FLUSH);
+		if (full && !z->avail_out)
+			return Z_MEM_ERROR;
+		if (!full)
+			out->size = out->capacity - z->avail_out;
+	} while (result == Z_OK && (z->avail_in || !z->avail_out));
+	// No progress without more input, the next chunk continues
+	if (result == Z_BUF_ERROR && !z->avail_in)
+		return Z_OK;
+	return result;
+}
+
+/*
+ * Read the whole file, a chunk at a time. If it is gzipped, it is
+ * decompressed on the way, so only the decompressed image is kept. NULL and
+ * the error if it fails.
+ */
+static uint8_t *file_read(const char *path, struct stat *st, size_t *size, const char **error) {
+	static char message[256];
+	static uint8_t chunk[64 * 1024];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		snprintf(message, sizeof message, "Couldn't open %s: %s", path, strerror(errno));
+		*error = message;
+		return NULL;
+	}
+	if (fstat(fd, st) == -1) {
+		snprintf(message, sizeof message, "Couldn't stat %s: %s", path, strerror(errno));
+		*error = message;
+		close(fd);
+		return NULL;
+	}
+	// Allocate at least one byte, so an empty image is not mistaken for an error
+	size_t hint = st->st_size + 1;
+	struct buffer buffer = { .data = NULL };
+	z_stream z = { .zalloc = Z_NULL };
+	bool first = true, gzip = false;
+	int z_result = Z_OK;
+	*message = '\0';
+	for (;;) {
+		ssize_t amount = read(fd, chunk, sizeof chunk);
+		if (amount == -1 && errno == EINTR)
+			continue;
+		if (amount == -1) {
+			snprintf(message, sizeof message, "Couldn't read %s: %s", path, strerror(errno));
+			break;
+		}
+		if (first) {
+			first = false;
+			gzip = amount >= 2 && chunk[0] == 0x1F && chunk[1] == 0x8B;
+			if (gzip) {
+				// Guess it shrank to about a third, the buffer grows if not
+				hint = 3 * st->st_size;
+				// 16 means to expect the gzip header
+				if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+					die("Couldn't initialize zlib: %s\n", z.msg ? z.msg : "unknown error");
+			}
+		}
+		if (!amount)
+			break;
+		if (!gzip) {
+			for (size_t pos = 0; pos < (size_t)amount && !*message; ) {
+				if (!buffer_grow(&buffer, hint)) {
+					snprintf(message, sizeof message, "Image %s is larger than %d MiB", path, IMAGE_MAX >> 20);
+					break;
+				}
+				size_t part = buffer.capacity - buffer.size < (size_t)amount - pos ? buffer.capacity - buffer.size : (size_t)amount - pos;
+				memcpy(buffer.data + buffer.size, chunk + pos, part);
+				buffer.size += part;
+				pos += part;
+			}
+		} else if (z_result == Z_STREAM_END) {
+			snprintf(message, sizeof message, "Image %s has data after the end of the compressed stream", path);
+		} else {
+			z_result = inflate_chunk(&z, &buffer, chunk, amount, hint);
+			if (z_result == Z_STREAM_END && z.avail_in)
+				snprintf(message, sizeof message, "Image %s has data after the end of the compressed stream", path);
+			else if (z_result == Z_MEM_ERROR)
+				snprintf(message, sizeof message, "Image %s decompresses to more than %d MiB", path, IMAGE_MAX >> 20);
+			else if (z_result != Z_OK && z_result != Z_STREAM_END)
+				snprintf(message, sizeof message, "Couldn't decompress %s: %s", path, z.msg ? z.msg : "corrupted data");
+		}
+		if (*message)
+			break;
+	}
+	if (gzip) {
+		if (!*message && z_result != Z_STREAM_END)
+			snprintf(message, sizeof message, "Compressed image %s is truncated", path);
+		inflateEnd(&z);
+	}
+	close(fd);
+	if (*message) {
+		*error = message;
+		free(buffer.data);
+		return NULL;
+	}
+	if (!buffer.data)
+		buffer.data = malloc(1); // An empty file
+	*size = buffer.size;
+	// Give back what the guess allocated over
+	return buffer.size < buffer.capacity ? realloc(buffer.data, buffer.size + 1) : buffer.data;
+}
+
+static struct image_file *file_find(const char *path) {
+	struct image_file *file;
+	for (file = files; file; file = file->next)
+		if (strcmp(file->path, path) == 0)
+			return file;
+	file = malloc(sizeof *file);
+	*file = (struct image_file) {
+		.path = strdup(path),
+		.next = files
+	};
+	files = file;
+	return file;
+}
+
+struct image *image_get(const char *path, const char **error) {
+	struct image_file *file = file_find(path);
+	struct stat st;
+	if (file->image && stat(path, &st) == 0 && !file_changed(&file->st, &st))
+		return file->image; // The usual case, nothing to read
+	size_t size;
+	uint8_t *data = file_read(path, &st, &size, error);
+	if (!data)
+		return NULL;
+	file->st = st;
+	uint32_t crc = checksum(data, size);
+	struct image *image;
+	for (image = images; image; image = image->next)
+		if (image->crc == crc && image->size == size && memcmp(image->data, data, size) == 0)
+			break;
+	if (image) {
+		dbg("Image %s is the same as one already loaded\n", path);
+		free(data);
+	} else {
+		image = malloc(sizeof *image);
+		*image = (struct image) {
+			.data = data,
+			.size = size,
+			.crc = crc,
+			.problem = size_problem(size) ? strdup(size_problem(size)) : NULL,
+			.next = images
+		};
+		images = image;
+		msg("Loaded firmware image %s (%zu bytes, CRC32 %08x)\n", path, size, (unsigned)crc);
+	}
+	// Reference the new one first, it may be the same as the old one
+	image_ref(image);
+	image_unref(file->image);
+	file->image = image;
+	return image;
+}
+
+const char *image_check(const struct image *image, bool crc_set, uint32_t crc) {
+	static char buffer[64];
+	if (image->problem)
+		return image->problem;
+	if (crc_set && image->crc != crc) {
+		snprintf(buffer, sizeof buffer, "CRC32 %08x instead of %08x", (unsigned)image->crc, (unsigned)crc);
+		return buffer;
+	}
+	return NULL;
+}
+
+bool image_report(const char *path, const char *problem) {
+	struct image_file *file = file_find(path);
+	bool known = problem && file->reported && strcmp(file->reported, problem) == 0;
+	if (!known) {
+		free(file->reported);
+		file->reported = problem ? strdup(problem) : NULL;
+	}
+	return problem && !known;
+}
+
+void image_prune(image_keep keep) {
+	for (struct image_file **file = &files; *file;) {
+		struct image_file *dropped = *file;
+		if (keep(dropped->path)) {
+			file = &dropped->next;
+			continue;
+		}
+		dbg("Image file %s no longer used\n", dropped->path);
+		*file = dropped->next;
+		image_unref(dropped->image);
+		free(dropped->path);
+		free(dropped->reported);
+		free(dropped);
+	}
+}
+
+void image_ref(struct image *image) {
+	image->refs ++;
+}
+
+void image_unref(struct image *image) {
+	if (!image || -- image->refs)
+		return;
+	for (struct image **i = &images; *i; i = &(*i)->next)
+		if (*i == image) {
+			*i = image->next;
+			break;
+		}
+	free((uint8_t *)image->data);
+	free((char *)image->problem);
+	free(image);
+}
@@ -0,0 +1,72 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_IMAGE_H
+#define SMRT_IMAGE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The store of the firmware images. Each file is read into memory once and
+ * kept there, the files with the same content share one image. The file is
+ * read again only when it changes (it is replaced by a new version), so it
+ * is not opened for each upload.
+ */
+struct image {
+	const uint8_t *data;
+	size_t size;
+	// CRC32 of the content (as zlib computes it), also used to find the same images
+	uint32_t crc;
+	// Why it can't be uploaded to a modem (NULL if it can), found out when it was loaded
+	const char *problem;
+	// How many users keep it (the files with this content and the uploads in progress)
+	unsigned refs;
+	struct image *next;
+};
+
+/*
+ * The current content of the image file, read again if the file changed
+ * since the last time. The image stays valid until the next call with the
+ * same path, use image_ref to keep it longer. NULL and the error if the file
+ * can't be read.
+ */
+struct image *image_get(const char *path, const char **error);
+/*
+ * Check the image can be uploaded: its size is valid and it has the
+ * expected CRC32 (if crc_set). Returns the problem, NULL if there's none.
+ */
+const char *image_check(const struct image *image, bool crc_set, uint32_t crc);
+/*
+ * Should the problem with the image file be logged? Each problem of a file
+ * is reported once, not for every modem that would get the image. NULL
+ * means the file is fine now.
+ */
+bool image_report(const char *path, const char *problem);
+/*
+ * Forget the files keep says no to (they are no longer configured). Their
+ * images are freed unless something else still uses them.
+ */
+typedef bool (*image_keep)(const char *path);
+void image_prune(image_keep keep);
+void image_ref(struct image *image);
+// Drop the reference, the image is freed once nobody uses it. NULL is allowed.
+void image_unref(struct image *image);
+
+#endif
@@ -21,6 +21,13 @@
 #include "automaton.h"
 #include "proto_const.h"
 #include "configuration.h"
+#include "line.h"
+#include "shm.h"
+#include "control.h"
+#include "metrics.h"
+#include "profile.h"
+#include "trace.h"
+#include "capture.h"
 
 #include <alloca.h>
 #include <stdlib.h>
@@ -47,15 +54,71 @@ struct interface_state {
 	enum autom_state autom_state;
 	bool timeout_active;
 	uint64_t timeout_dest;
-	int timeout, timeout_add, timeout_mult, retries;
+	int timeout, timeout_add, timeout_mult, retries, timeout_jitter, timeout_slack;
+	// Position of this interface inside the jitter interval, for the first timeout after a transition
+	uint32_t phase;
 	void *packet;
 	size_t packet_size;
+	// When the last request was sent, to measure the round trip time. Not measured if it was sent multiple times.
+	uint64_t request_sent;
+	bool request_pending;
 	struct extra_state *extra_state;
 	uint8_t mac_addr[ETH_ALEN];
 	int ifindex;
+	// Where the frames go instead of the socket (virtual interfaces only)
+	interface_send_hook send_hook;
+	interface_wake_hook wake_hook;
+	void *send_data;
+	struct line line;
+	struct capture capture;
 };
 
-struct interface_state *interface_alloc(const char *name, int *fd) {
+static void transition_perform(struct interface_state *interface, uint64_t now, const struct transition *transition);
+
+// The line got an upload slot it waited for. Time out right away, the automaton goes on from there.
+static void upload_wake(void *data) {
+	struct interface_state *interface = data;
+	interface->timeout_active = true;
+	interface->timeout_dest = 0;
+	interface->timeout_slack = 0;
+	interface->retries = 0;
+	if (interface->wake_hook)
+		interface->wake_hook(interface->send_data);
+}
+
+// The part of the setup common to the real and virtual interfaces
+static struct interface_state *interface_setup(const char *name, uint64_t now, int fd, int ifindex, const uint8_t *mac_addr, int mtu) {
+	struct interface_state *result = malloc(sizeof *result);
+	*result = (struct interface_state) {
+		.ifname = strdup(name),
+		.fd = fd,
+		.autom_state = AS_PRESTART,
+		.ifindex = ifindex,
+		/*
+		 * Multiples of the golden ratio (in fixed point). Interfaces with
+		 * consecutive indices get phases evenly spread over the interval.
+		 */
+		.phase = (uint32_t)ifindex * 2654435769U
+	};
+	memcpy(result->mac_addr, mac_addr, ETH_ALEN);
+	result->line.ifname = result->ifname;
+	result->line.mtu = mtu;
+	status_init(&result->line.status, name);
+	result->line.shm_slot = shm_slot_alloc(name);
+	result->line.history = history_resume(name, now);
+	result->line.upload.wake = upload_wake;
+	result->line.upload.wake_data = result;
+	metrics_register(&result->line.metrics, result->ifname);
+	watchdog_init(&result->line.watchdog);
+	trace_name(ifindex, name);
+	capture_init(&result->capture, result->ifname);
+	// Enter the initial state, which arms the first timeout (spread by the phase, like the others)
+	result->line.now = now;
+	transition_perform(result, now, state_enter(&result->line, AS_PRESTART, NULL));
+	return result;
+}
+
+struct interface_state *interface_alloc(const char *name, uint64_t now, int *fd) {
 	// We communicate over ethernet frames, so we need to manipulate them on rather low level.
 	int sock = socket(AF_PACKET, SOCK_RAW, htons(CONTROL_PROTOCOL));
 	if (sock == -1)
@@ -77,6 +140,12 @@ struct interface_state *interface_alloc(const char *name, int *fd) {
 	int ifindex = req.ifr_ifindex;
 	if (ioctl(sock, SIOCGIFHWADDR, &req) == -1)
 		die("Couldn't get mac address for interface %s: %s\n", name, strerror(errno));
+	uint8_t mac_addr[ETH_ALEN];
+	memcpy(mac_addr, req.ifr_hwaddr.sa_data, ETH_ALEN);
+	if (ioctl(sock, SIOCGIFMTU, &req) == -1)
+		die("Couldn't get MTU of interface %s: %s\n", name, strerror(errno));
+	int mtu = req.ifr_mtu;
+	dbg("Interface %s has MTU %d\n", name, mtu);
 	struct sockaddr_ll addr = {
 		.sll_family = AF_PACKET,
 		.sll_protocol = htons(CONTROL_PROTOCOL),
@@ -85,50 +154,101 @@ struct interface_state *interface_alloc(const char *name, int *fd) {
 	if (bind(sock, (struct sockaddr *)&addr, sizeof addr) == -1)
 		die("Couldn't bind AF_PACKET socket %d to interface %s: %s\n", sock, name, strerror(errno));
 	*fd = sock;
-	struct interface_state *result = malloc(sizeof *result);
-	*result = (struct interface_state) {
-		.ifname = strdup(name),
-		.fd = sock,
-		.autom_state = AS_PRESTART,
-		.timeout_active = true,
-		.ifindex = ifindex
-	};
-	memcpy(result->mac_addr, req.ifr_hwaddr.sa_data, ETH_ALEN);
+	return interface_setup(name, now, sock, ifindex, mac_addr, mtu);
+}
+
+struct interface_state *interface_alloc_virtual(const char *name, uint64_t now, int ifindex, const uint8_t *mac_addr, int mtu, interface_send_hook hook, interface_wake_hook wake, void *data) {
+	struct interface_state *result = interface_setup(name, now, -1, ifindex, mac_addr, mtu);
+	result->send_hook = hook;
+	result->wake_hook = wake;
+	result->send_data = data;
 	return result;
 }
 
 void interface_release(struct interface_state *interface) {
-	if (close(interface->fd) == -1)
+	if (interface->fd != -1 && close(interface->fd) == -1)
 		die("Couldn't close interface's communication socket %d: %s\n", interface->fd, strerror(errno));
 	extra_state_destroy(interface->extra_state);
-	const char *path = interface_status_path(interface->ifname);
-	if (unlink(path) == -1) {
-		if (errno == ENOENT)
-			msg("File %s not removed as it doesn't exist\n", path);
-		else
-			die("Couldn't remove interface status file %s: %s\n", path, strerror(errno));
-	}
+	upload_release(&interface->line.upload);
+	status_destroy(&interface->line.status);
+	shm_slot_free(interface->line.shm_slot);
+	history_suspend(interface->line.history, interface->ifname);
+	image_unref(interface->line.image);
+	free(interface->line.image_version);
+	metrics_unregister(&interface->line.metrics);
+	capture_destroy(&interface->capture);
 	free(interface->ifname);
 	free(interface->packet);
 	free(interface);
 }
 
+int interface_ifindex(const struct interface_state *interface) {
+	return interface->ifindex;
+}
+
 int interface_timeout(struct interface_state *interface, uint64_t now) {
 	if (interface->timeout_active) {
-		if (now >= interface->timeout_dest)
+		uint64_t latest = interface->timeout_dest + interface->timeout_slack;
+		if (now >= latest)
 			return 0; // Already timed out
 		else
-			return interface->timeout_dest - now;
+			return latest - now;
 	} else
 		return -1;
 }
 
+bool interface_due(struct interface_state *interface, uint64_t now) {
+	return interface->timeout_active && now >= interface->timeout_dest;
+}
+
+/*
+ * Schedule the next timeout. The first one after a transition is offset by
+ * the phase of the interface (so interfaces entering the same state at the
+ * same time are spread evenly), the later ones randomly.
+ */
+static void timeout_arm(struct interface_state *interface, uint64_t now, bool first) {
+	uint64_t offset = 0;
+	if (interface->timeout_jitter > 0) {
+		if (first)
+			offset = ((uint64_t)interface->phase * interface->timeout_jitter) >> 32;
+		else
+			offset = random() % interface->timeout_jitter;
+	}
+	interface->timeout_dest = now + interface->timeout + offset;
+}
+
 struct packet_basic {
 	struct ethhdr hdr;
 	uint8_t data[];
 } __attribute__((packed));
 
-static void packet_send(struct interface_state *interface) {
+// Put the frame on the wire
+static void frame_send(struct interface_state *interface, const void *frame, size_t size) {
+	if (interface->send_hook) {
+		interface->send_hook(interface->send_data, frame, size);
+		return;
+	}
+	// Address (it only says the interface)
+	struct sockaddr_ll addr = {
+		.sll_family = AF_PACKET,
+		.sll_ifindex = interface->ifindex,
+		.sll_protocol = htons(CONTROL_PROTOCOL)
+	};
+	ssize_t sent;
+	while ((sent = sendto(interface->fd, frame, size, MSG_NOSIGNAL, (struct sockaddr *)&addr, sizeof addr)) == -1 && errno == EINTR)
+		; // Interrupted when sending. Retry.
+	if (sent == -1 && (errno == ENETDOWN || errno == ENXIO || errno == ENOBUFS)) {
+		// The link just went down (we'll hear from netlink soon) or the queue is full. The frame is lost, like on the wire.
+		dbg("Couldn't send packet of size %zu on interface %d: %s\n", size, interface->ifindex, strerror(errno));
+		return;
+	}
+	if (sent == -1)
+		die("Couldn't send packet of size %zu on interface %d and fd %d: %s\n", size, interface->ifindex, interface->fd, strerror(errno));
+	if ((size_t)sent != size)
+		die("Sent only %zd bytes out of %zu on packet on interface %d and fd %d\n", sent, size, interface->ifindex, interface->fd);
+}
+
+static void packet_send(struct interface_state *interface, uint64_t now) {
 	if (!interface->packet)
 		return; // No packet to send
 	// Assemble the packet with the header
@@ -140,22 +260,45 @@ static void packet_send(struct interface_state *interface) {
 	};
 	memcpy(p->hdr.h_source, interface->mac_addr, ETH_ALEN);
 	memcpy(p->data, interface->packet, interface->packet_size);
-	// Address (it only says the interface)
-	struct sockaddr_ll addr = {
-		.sll_family = AF_PACKET,
-		.sll_ifindex = interface->ifindex,
-		.sll_protocol = htons(CONTROL_PROTOCOL)
-	};
-	ssize_t sent = sendto(interface->fd, p, size, MSG_NOSIGNAL, (struct sockaddr *)&addr, sizeof addr);
-	if (sent == -1) {
-		if (errno == EINTR) {// Interrupted when sending. Retry.
-			packet_send(interface);
-			return;
-		}
-		die("Couldn't send packet of size %zu on interface %d and fd %d: %s\n", size, interface->ifindex, interface->fd, strerror(errno));
+	frame_send(interface, p, size);
+	metric_inc(&interface->line.metrics, MC_FRAMES_SENT);
+	capture_frame(&interface->capture, now, p, size);
+}
+
+// Record a frame into the trace (the command and the sequence number of the parameter commands)
+static void trace_packet(const struct interface_state *interface, uint64_t now, enum trace_event event, const uint8_t *data, size_t size) {
+	unsigned cmd = size ? data[0] : 0, seq = 0;
+	if (cmd >= CMD_GET_PARAM && size >= 5)
+		seq = data[3] << 8 | data[4];
+	trace(now, interface->ifindex, event, interface->autom_state, seq, size, cmd);
+}
+
+// Update the metrics related to entering a new state
+static void state_metrics(struct interface_state *interface, uint64_t now) {
+	struct line *line = &interface->line;
+	line->metrics.state = interface->autom_state;
+	metric_inc(&line->metrics, MC_TRANSITIONS);
+	switch (interface->autom_state) {
+		case AS_ASKED_PRESENT:
+			if (!line->init_start)
+				line->init_start = now;
+			break;
+		case AS_WATCH:
+			if (line->init_start) {
+				metric_observe(MH_TIME_TO_ONLINE, (now - line->init_start) / 1000);
+				line->init_start = 0;
+			}
+			break;
+		case AS_RESET:
+			metric_inc(&line->metrics, MC_RESETS);
+			break;
+		case AS_DEAD:
+			metric_inc(&line->metrics, MC_DEAD);
+			line->init_start = 0;
+			break;
+		default:
+			break;
 	}
-	if ((size_t)sent != size)
-		die("Sent only %zd bytes out of %zu on packet on interface %d and fd %d\n", sent, size, interface->ifindex, interface->fd);
 }
 
 static void transition_perform(struct interface_state *interface, uint64_t now, const struct transition *transition) {
@@ -166,8 +309,10 @@ static void transition_perform(struct interface_state *interface, uint64_t now,
 		interface->timeout = transition->timeout;
 		interface->timeout_add = transition->timeout_add;
 		interface->timeout_mult = transition->timeout_mult;
-		interface->timeout_dest = transition->timeout + now;
+		interface->timeout_jitter = transition->timeout_jitter;
+		interface->timeout_slack = transition->timeout_slack;
 		interface->retries = transition->retries;
+		timeout_arm(interface, now, true);
 	}
 	interface->timeout_active = transition->timeout_set;
 	// The packet
@@ -176,42 +321,57 @@ static void transition_perform(struct interface_state *interface, uint64_t now,
 	if (transition->packet_send) {
 		size_t size = interface->packet_size = transition->packet_size;
 		memcpy(interface->packet = malloc(size), transition->packet, size);
-		packet_send(interface);
+		packet_send(interface, now);
+		trace_packet(interface, now, TE_TX, interface->packet, interface->packet_size);
+		interface->request_sent = now;
+		interface->request_pending = true;
 	}
 	// Extra state (just store it)
 	interface->extra_state = transition->extra_state;
 	// Name of state
 	if (transition->status_name) {
-		const char *path = interface_status_path(interface->ifname);
-		FILE *f = fopen(path, "w");
-		if (!f)
-			die("Failed to write status to file %s: %s\n", path, strerror(errno));
-		fprintf(f, "<status>%s</status>\n", transition->status_name);
+		status_begin(&interface->line.status);
+		status_printf(&interface->line.status, "<status>%s</status>\n", transition->status_name);
 		dbg("State %s\n", transition->status_name);
-		if (fclose(f) == EOF)
-			die("Failed to close status file %s: %s\n", path, strerror(errno));
+		status_commit(&interface->line.status);
+		shm_status(interface->line.shm_slot, transition->status_name, now);
 	}
 	// The state
 	if (transition->state_change) {
-		dbg("Changing state to %u\n", (unsigned)transition->new_state);
+		dbg("Changing state to %s\n", autom_state_name(transition->new_state));
+		profile_transition(&interface->line.profile, interface->autom_state, transition->new_state, now);
+		trace(now, interface->ifindex, TE_ENTER, transition->new_state, 0, 0, interface->autom_state);
 		interface->autom_state = transition->new_state;
-		transition_perform(interface, now, state_enter(interface->ifname, interface->autom_state, interface->extra_state)); // Also enter the new state
+		shm_state(interface->line.shm_slot, interface->autom_state, now);
+		state_metrics(interface, now);
+		interface->line.now = now;
+		transition_perform(interface, now, state_enter(&interface->line, interface->autom_state, interface->extra_state)); // Also enter the new state
 	}
 }
 
 void interface_tick(struct interface_state *interface, uint64_t now) {
+	// A woken up interface has no deadline
+	if (interface->timeout_dest)
+		metric_observe(MH_TIMER_LATENESS, now > interface->timeout_dest ? now - interface->timeout_dest : 0);
 	if (interface->retries) {
 		dbg("Resending packet\n");
 		// We should try sending the packet again as long we have retries
-		packet_send(interface);
+		packet_send(interface, now);
+		metric_inc(&interface->line.metrics, MC_RETRANSMITS);
+		trace_packet(interface, now, TE_RETRANSMIT, interface->packet, interface->packet_size);
+		// We wouldn't know which of the copies got answered
+		interface->request_pending = false;
 		interface->retries --;
 		// Compute a new timeout
 		interface->timeout = interface->timeout * interface->timeout_mult + interface->timeout_add;
-		interface->timeout_dest = now + interface->timeout;
+		timeout_arm(interface, now, false);
 	} else {
 		dbg("Timed out\n");
+		metric_inc(&interface->line.metrics, MC_TIMEOUTS);
+		trace(now, interface->ifindex, TE_TIMEOUT, interface->autom_state, 0, 0, 0);
 		// OK, we sent all the retries. We really timed out. So enter a new state.
-		transition_perform(interface, now, state_timeout(interface->ifname, interface->autom_state, interface->extra_state));
+		interface->line.now = now;
+		transition_perform(interface, now, state_timeout(&interface->line, interface->autom_state, interface->extra_state));
 	}
 }
 
@@ -226,11 +386,107 @@ void interface_read(struct interface_state *interface, uint64_t now) {
 	if (received > RECV_PACKET_LEN)
 		die("Packet of size %zd received, but I have space only for %u (interface %d, fd %d)\n", received, (unsigned)RECV_PACKET_LEN, interface->ifindex, interface->fd);
 	dbg("Packet from the modem on interface %d fd %d of size %zd\n", interface->ifindex, interface->fd, received);
-	struct packet_basic *p = (struct packet_basic *)buffer;
+	interface_input(interface, now, buffer, received);
+}
+
+void interface_input(struct interface_state *interface, uint64_t now, const uint8_t *frame, size_t received) {
+	capture_frame(&interface->capture, now, frame, received);
+	const struct packet_basic *p = (const struct packet_basic *)frame;
+	if (received < sizeof p->hdr) {
+		dbg("Runt packet of size %zu received and ignored\n", received);
+		metric_inc(&interface->line.metrics, MC_FOREIGN_FRAMES);
+		return;
+	}
 	if (memcmp(p->hdr.h_source, dest_mac, ETH_ALEN) != 0 || memcmp(p->hdr.h_dest, interface->mac_addr, ETH_ALEN) != 0 || p->hdr.h_proto != htons(CONTROL_PROTOCOL)) {
 		dbg("Foreign packet received and ignored\n");
+		metric_inc(&interface->line.metrics, MC_FOREIGN_FRAMES);
+		trace(now, interface->ifindex, TE_FOREIGN, interface->autom_state, 0, received, 0);
 		return;
 	}
-	dbg("Packet on interface %d fd %d of size %zd\n", interface->ifindex, interface->fd, received);
-	transition_perform(interface, now, state_packet(interface->ifname, interface->autom_state, interface->extra_state, p->data, received - sizeof p->hdr));
+	dbg("Packet on interface %d fd %d of size %zu\n", interface->ifindex, interface->fd, received);
+	metric_inc(&interface->line.metrics, MC_FRAMES_RECEIVED);
+	trace_packet(interface, now, TE_RX, p->data, received - sizeof p->hdr);
+	interface->line.now = now;
+	const struct transition *transition = state_packet(&interface->line, interface->autom_state, interface->extra_state, p->data, received - sizeof p->hdr);
+	if (transition && interface->request_pending) {
+		// The packet was an answer to our request
+		metric_observe(MH_RTT, now - interface->request_sent);
+		interface->request_pending = false;
+	}
+	transition_perform(interface, now, transition);
+}
+
+// Move to the given state, no matter what state we are in now
+static void state_force(struct interface_state *interface, uint64_t now, enum autom_state state) {
+	extra_state_destroy(interface->extra_state);
+	interface->extra_state = NULL;
+	const struct transition transition = {
+		.new_state = state,
+		.state_change = true
+	};
+	transition_perform(interface, now, &transition);
+}
+
+const char *interface_command(struct interface_state *interface, uint64_t now, enum interface_command command) {
+	switch (command) {
+		case IC_RESET:
+		case IC_REFLASH:
+			interface->line.now = now;
+			line_msg(&interface->line, "Resetting modem on request\n");
+			state_force(interface, now, AS_RESET);
+			return NULL;
+		case IC_QUERY:
+			// Querying in the middle of the initialization would break it
+			if (interface->autom_state != AS_WATCH)
+				return "The modem is not running";
+			state_force(interface, now, AS_CONFIRM_WORKING);
+			return NULL;
+	}
+	return "Unknown command";
+}
+
+void interface_reconfigure(struct interface_state *interface, uint64_t now) {
+	interface->line.now = now;
+	bool firmware_changed = line_firmware_changed(&interface->line);
+	switch (interface->autom_state) {
+		case AS_PRESTART:
+		case AS_ASKED_PRESENT:
+		case AS_UPLOAD_WAIT:
+		case AS_RESET:
+		case AS_DEAD:
+			// Nothing given to the modem yet (or it starts over anyway), it gets the new configuration on its own
+			return;
+		case AS_INVALID_IMAGE:
+			// The reload succeeded, so the images are fine now
+			state_force(interface, now, AS_ASKED_PRESENT);
+			return;
+		case AS_WATCH:
+			if (firmware_changed)
+				break;
+			// Wake up only if there's something to send, the others keep sleeping
+			if (line_conns_changed(&interface->line))
+				state_force(interface, now, AS_WATCH);
+			return;
+		default:
+			// In the middle of the initialization, the mappings are checked once it gets to watching
+			if (firmware_changed)
+				break;
+			return;
+	}
+	line_msg(&interface->line, "Firmware changed, reflashing the modem\n");
+	state_force(interface, now, AS_RESET);
+}
+
+void interface_history(struct interface_state *interface, uint64_t now, struct control_client *client) {
+	control_printf(client, "interface %s\n", interface->ifname);
+	history_dump(interface->line.history, now, client);
+}
+
+void interface_profile(struct interface_state *interface, uint64_t now, struct control_client *client) {
+	profile_dump_interface(&interface->line.profile, interface->ifname, interface->autom_state, now, client);
+}
+
+void interface_dump(struct interface_state *interface, uint64_t now, struct control_client *client) {
+	const struct status *status = &interface->line.status;
+	control_printf(client, "<interface name='%s' state='%u' timeout='%d'>\n%.*s</interface>\n", interface->ifname, (unsigned)interface->autom_state, interface_timeout(interface, now), (int)status->written_len, status->written);
 }
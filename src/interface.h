@@ -20,19 +20,64 @@
 #define SMRT_INTERFACE_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 struct interface_state;
 
 // Create a new interface with given name. The fd is out-parameter and it is a file descriptor to watch for new packets.
-struct interface_state *interface_alloc(const char *name, int *fd);
+struct interface_state *interface_alloc(const char *name, uint64_t now, int *fd);
+/*
+ * Create an interface without a socket, for the simulation. The frames it
+ * sends are passed to the hook and the frames for it are given to
+ * interface_input. All the timing comes from the now parameters.
+ */
+typedef void (*interface_send_hook)(void *data, const void *frame, size_t size);
+/*
+ * The interface became due by something else than its own events (eg. another
+ * line freed an upload slot), the timeout needs to be looked at again. May be
+ * NULL.
+ */
+typedef void (*interface_wake_hook)(void *data);
+struct interface_state *interface_alloc_virtual(const char *name, uint64_t now, int ifindex, const uint8_t *mac_addr, int mtu, interface_send_hook hook, interface_wake_hook wake, void *data);
 // Destroy previosly created interface.
 void interface_release(struct interface_state *interface);
 
-// Return number of milliseconds after which the interface should „tick“. -1 is never.
+// Return number of milliseconds after which the interface must „tick“ at the latest. -1 is never.
 int interface_timeout(struct interface_state *interface, uint64_t now);
+// Is it time for the interface to „tick“ already? It may be a bit sooner than the interface_timeout, if there's some slack.
+bool interface_due(struct interface_state *interface, uint64_t now);
+// The kernel index of the interface
+int interface_ifindex(const struct interface_state *interface);
 // The interface timeout reached 0, so this gets called.
 void interface_tick(struct interface_state *interface, uint64_t now);
 // There's a packet on the interface.
 void interface_read(struct interface_state *interface, uint64_t now);
+// Handle a frame (including the ethernet header) that came to the interface.
+void interface_input(struct interface_state *interface, uint64_t now, const uint8_t *frame, size_t size);
+
+enum interface_command {
+	// Reset the modem and start from the beginning
+	IC_RESET,
+	// Upload the firmware again (the modem has no permanent memory, so this means a reset too)
+	IC_REFLASH,
+	// Ask for the line status right now
+	IC_QUERY
+};
+
+// Perform a command from the operator. Returns NULL on success, error message otherwise.
+const char *interface_command(struct interface_state *interface, uint64_t now, enum interface_command command);
+/*
+ * The configuration was reloaded. Reflash the modem if its firmware changed,
+ * otherwise send the connection mappings that changed to a running modem.
+ */
+void interface_reconfigure(struct interface_state *interface, uint64_t now);
+struct control_client;
+// Describe the interface into the control answer
+void interface_dump(struct interface_state *interface, uint64_t now, struct control_client *client);
+// Write the history of line statistics into the control answer
+void interface_history(struct interface_state *interface, uint64_t now, struct control_client *client);
+// Write the current state and how long the interface is in it into the control answer
+void interface_profile(struct interface_state *interface, uint64_t now, struct control_client *client);
 
 #endif
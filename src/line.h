@@ -0,0 +1,71 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_LINE_H
+#define SMRT_LINE_H
+
+#include "watchdog.h"
+#include "upload.h"
+#include "status.h"
+#include "history.h"
+#include "metrics.h"
+#include "profile.h"
+#include "configuration.h"
+#include "image.h"
+#include "util.h"
+
+#include <stdint.h>
+
+/*
+ * Information about a line (an interface with possibly a modem on it) that
+ * the automaton may use. Unlike the extra_state, this survives the state
+ * changes and lives as long as the interface is up.
+ */
+struct line {
+	const char *ifname;
+	// Time of the event being processed right now, in milliseconds
+	uint64_t now;
+	struct watchdog watchdog;
+	// How many times in a row we looked for a modem that is not present
+	unsigned dead_probes;
+	struct upload upload;
+	// MTU of the interface
+	int mtu;
+	// The largest image part the modem is known to accept
+	uint32_t chunk_good;
+	// The image part size used now. If it is larger than chunk_good, we are probing.
+	uint32_t chunk_size;
+	// A larger image part got stuck, don't try larger ones again
+	bool chunk_probe_failed;
+	struct status status;
+	// Record in the shared memory status region (-1 if none)
+	int shm_slot;
+	struct history *history;
+	struct metrics metrics;
+	struct profile profile;
+	// The firmware image and version last offered to the modem (NULL if none yet)
+	struct image *image;
+	char *image_version;
+	// The connection mappings as sent to the modem
+	struct conn_mapping conns[MAX_CONN_CNT];
+	// When we started to initialize the modem (0 if it's not being initialized)
+	uint64_t init_start;
+	struct log_limit log_limit;
+};
+
+#endif
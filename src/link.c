@@ -23,10 +23,50 @@
 #include <string.h>
 #include <asm/types.h>
 #include <sys/socket.h>
+#include <net/if.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
 static int sock = -1;
+static netlink_name_hook name_hook, removed_hook;
+
+// Tell the hook about all the interfaces there are
+static void names_all(void) {
+	if (!name_hook)
+		return;
+	struct if_nameindex *names = if_nameindex();
+	if (!names)
+		die("Couldn't list the interfaces: %s\n", strerror(errno));
+	for (const struct if_nameindex *n = names; n->if_name; n ++)
+		name_hook(n->if_name);
+	if_freenameindex(names);
+}
+
+void netlink_set_hooks(netlink_name_hook name, netlink_name_hook removed) {
+	name_hook = name;
+	removed_hook = removed;
+	names_all();
+}
+
+void netlink_rescan(void) {
+	names_all();
+}
+
+// Find the name of the interface in the link message and pass it to the hook
+static void names_message(struct nlmsghdr *nh, netlink_name_hook hook) {
+	if (!hook || nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+		return;
+	size_t len = IFLA_PAYLOAD(nh);
+	for (struct rtattr *attr = IFLA_RTA(NLMSG_DATA(nh)); RTA_OK(attr, len); attr = RTA_NEXT(attr, len))
+		if (attr->rta_type == IFLA_IFNAME) {
+			char name[IFNAMSIZ];
+			size_t name_len = RTA_PAYLOAD(attr) < sizeof name ? RTA_PAYLOAD(attr) : sizeof name - 1;
+			memcpy(name, RTA_DATA(attr), name_len);
+			name[name_len] = '\0';
+			hook(name);
+			return;
+		}
+}
 
 int netlink_init(void) {
 	sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
@@ -58,18 +98,24 @@ bool netlink_event(void) {
 	if (slen == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
 			return false; // No data now, so no event
-		if (errno == ENOBUFS)
-			return false; // OK, there was not enough memory to send us message. The message may have contained something interesting, so expect it did contain and err on the safe side
+		if (errno == ENOBUFS) {
+			names_all(); // Some new interface might have been in the lost messages
+			return true; // OK, there was not enough memory to send us message. The message may have contained something interesting, so expect it did contain and err on the safe side
+		}
 		die("Error reading netlink data: %s\n", strerror(errno));
 	}
 	// A 0-length datagram is allowed. No idea why would anyone do that, but it's not an error and its not EOF here, so don't special-case it
-	if (msg.msg_flags & MSG_TRUNC)
+	if (msg.msg_flags & MSG_TRUNC) {
+		names_all();
 		return true; // We didn't read all the data from the packet. The part we lost might as well have contained the event we watch for, so we better expect there was one and err on the safe side.
+	}
 
 	size_t len = slen; // Make sure it's unsigned, otherwise the next line complains with warning.
+	// Go through all the messages, each of them may name another interface
+	bool interesting = false;
 	for (struct nlmsghdr *nh = (struct nlmsghdr *)msg_buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
 		if (nh->nlmsg_type == NLMSG_DONE)
-			return false; // Nothing interesting so far and this one is a sentinel
+			break; // This one is a sentinel
 
 		if (nh->nlmsg_type == NLMSG_NOOP)
 			continue; // No idea why this is here, but ignore no-operation messages.
@@ -80,11 +126,13 @@ bool netlink_event(void) {
 			die("Error sent over netlink: %s\n", strerror(-err->error));
 		}
 
-		if (nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK) // If it's about link, it's interesting
-			return true;
+		if (nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK) { // If it's about link, it's interesting
+			names_message(nh, nh->nlmsg_type == RTM_NEWLINK ? name_hook : removed_hook);
+			interesting = true;
+		}
 
 		// The rest that may be here is not interesting to us at all, just continue
 	}
 
-	return false; // Nothing interesting in the whole message
+	return interesting;
 }
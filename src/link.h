@@ -25,5 +25,15 @@
 int netlink_init(void);
 // There was an event on the netlink socket. Is it a link up/down event?
 bool netlink_event(void);
+/*
+ * Call the name hook with the name of each interface the link messages talk
+ * about, so new interfaces can be discovered. It is called for all the
+ * existing interfaces right away and whenever some messages were lost. The
+ * removed hook is called with the name of each interface that was deleted.
+ */
+typedef void (*netlink_name_hook)(const char *ifname);
+void netlink_set_hooks(netlink_name_hook name, netlink_name_hook removed);
+// Call the hook for all the existing interfaces again (the configuration changed)
+void netlink_rescan(void);
 
 #endif
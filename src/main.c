@@ -21,6 +21,13 @@
 #include "util.h"
 #include "interface.h"
 #include "configuration.h"
+#include "shm.h"
+#include "control.h"
+#include "metrics.h"
+#include "profile.h"
+#include "trace.h"
+#include "capture.h"
+#include "automaton.h"
 
 #include <errno.h>
 #include <string.h>
@@ -30,14 +37,18 @@
 #include <time.h>
 #include <assert.h>
 #include <stdlib.h>
-#include <syslog.h>
 #include <signal.h>
+#include <unistd.h>
 
 struct epoll_tag {
 	void (*hook)(struct epoll_tag *tag);
 	int fd;
 	const char *name;
 	size_t idx;
+	struct control_client *client;
+	// Errors on the descriptor are handled by the hook
+	bool own_errors;
+	enum metric_wakeup wakeup;
 };
 
 struct interface_wrapper {
@@ -75,9 +86,11 @@ static void up(const char *ifname) {
 	*interfaces[idx].tag = (struct epoll_tag) {
 		.hook = interface_packet,
 		.name = interfaces[idx].name,
-		.idx = idx
+		.idx = idx,
+		.wakeup = MW_FRAME
 	};
-	interfaces[idx].state = interface_alloc(ifname, &interfaces[idx].tag->fd);
+	interfaces[idx].state = interface_alloc(ifname, now, &interfaces[idx].tag->fd);
+	trace(now, interface_ifindex(interfaces[idx].state), TE_LINK_UP, AS_PRESTART, 0, 0, 0);
 	struct epoll_event event = {
 		.events = EPOLLIN,
 		.data.ptr = interfaces[idx].tag
@@ -92,11 +105,47 @@ static void down(const char *ifname) {
 	size_t last = interface_count - 1;
 	dbg("Releasing interface structure %s on index %d (%zu moves to %d)\n", ifname, idx, last, idx);
 	interfaces[last].tag->idx = idx;
+	trace(now, interface_ifindex(interfaces[idx].state), TE_LINK_DOWN, 0, 0, 0, 0);
 	// This will also close the file descriptor, which will remove it from the poller
 	interface_release(interfaces[idx].state);
 	free(interfaces[idx].tag);
 	free(interfaces[idx].name);
-	interfaces = realloc(interfaces, (interface_count --) * sizeof *interfaces);
+	interfaces[idx] = interfaces[last];
+	interfaces = realloc(interfaces, (-- interface_count) * sizeof *interfaces);
+}
+
+// An interface appeared (or changed). Watch it if the configuration has it (by a pattern).
+static void discovered(const char *ifname) {
+	if (iface_conns(ifname))
+		netstate_add(ifname);
+}
+
+// Stop watching the deleted interface if it got configured only through a pattern
+static void removed(const char *ifname) {
+	if (iface_forget(ifname))
+		netstate_remove(ifname);
+}
+
+// Is the interface still in the configuration?
+static bool configured(const char *ifname) {
+	return iface_conns(ifname) != NULL;
+}
+
+/*
+ * Read the config file again and apply only what changed. The interfaces
+ * that are no longer configured go away and the newly configured ones are
+ * watched, the rest keep running.
+ */
+static const char *reload(void) {
+	const char *error = configure_reload();
+	if (error)
+		return error;
+	netstate_prune(configured);
+	netlink_rescan();
+	netstate_update();
+	for (size_t i = 0; i < interface_count; i ++)
+		interface_reconfigure(interfaces[i].state, now);
+	return NULL;
 }
 
 static void netlink_ready(struct epoll_tag *unused) {
@@ -109,6 +158,163 @@ static void netlink_ready(struct epoll_tag *unused) {
 	}
 }
 
+static void control_client_ready(struct epoll_tag *tag) {
+	switch (control_ready(tag->client)) {
+		case CW_READ:
+			break; // Still waiting for the command, keep watching for input
+		case CW_WRITE: {
+			struct epoll_event event = {
+				.events = EPOLLOUT,
+				.data.ptr = tag
+			};
+			if (epoll_ctl(poller, EPOLL_CTL_MOD, tag->fd, &event) == -1)
+				die("Couldn't switch control connection %d to writing: %s\n", tag->fd, strerror(errno));
+			break;
+		}
+		case CW_CLOSE:
+			// This closes the descriptor, which removes it from the poller
+			control_release(tag->client);
+			free(tag);
+			break;
+	}
+}
+
+static void control_connection(struct epoll_tag *unused) {
+	(void)unused;
+	struct control_client *client;
+	int fd;
+	while ((client = control_accept(&fd))) {
+		struct epoll_tag *tag = malloc(sizeof *tag);
+		*tag = (struct epoll_tag) {
+			.hook = control_client_ready,
+			.fd = fd,
+			.name = "Control connection",
+			.client = client,
+			.own_errors = true,
+			.wakeup = MW_CONTROL
+		};
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.ptr = tag
+		};
+		if (epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event) == -1)
+			die("Couldn't add control connection %d to epoll: %s\n", fd, strerror(errno));
+	}
+}
+
+static const struct {
+	const char *name;
+	enum interface_command command;
+} interface_commands[] = {
+	{ "reset", IC_RESET },
+	{ "reflash", IC_REFLASH },
+	{ "query", IC_QUERY }
+};
+
+// Run an interface command on the interfaces listed (or all of them)
+static void control_interfaces(struct control_client *client, enum interface_command command, size_t argc, char *argv[]) {
+	if (!argc) {
+		control_printf(client, "error No interfaces specified\n");
+		return;
+	}
+	bool all = argc == 1 && strcmp(argv[0], "all") == 0;
+	size_t count = all ? interface_count : argc;
+	for (size_t i = 0; i < count; i ++) {
+		int idx = all ? (int)i : interface_idx(argv[i]);
+		if (idx == -1) {
+			control_printf(client, "%s error Not an active interface\n", argv[i]);
+			continue;
+		}
+		// Remember the name, it is owned by the interfaces table
+		const char *name = interfaces[idx].name;
+		const char *error = interface_command(interfaces[idx].state, now, command);
+		if (error)
+			control_printf(client, "%s error %s\n", name, error);
+		else
+			control_printf(client, "%s ok\n", name);
+	}
+	control_printf(client, "ok\n");
+}
+
+static void control_command(struct control_client *client, const char *command, size_t argc, char *argv[]) {
+	if (strcmp(command, "dump") == 0) {
+		for (size_t i = 0; i < interface_count; i ++)
+			interface_dump(interfaces[i].state, now, client);
+		control_printf(client, "ok\n");
+		return;
+	}
+	if (strcmp(command, "metrics") == 0) {
+		metrics_dump(client);
+		return;
+	}
+	if (strcmp(command, "trace") == 0) {
+		// Only into the file given on the command line, the clients don't get to choose what is overwritten
+		if (argc) {
+			control_printf(client, "error Usage: trace\n");
+			return;
+		}
+		const char *error = trace_dump(trace_path);
+		if (error)
+			control_printf(client, "error %s\n", error);
+		else
+			control_printf(client, "ok\n");
+		return;
+	}
+	if (strcmp(command, "reload") == 0) {
+		const char *error = argc ? "Usage: reload" : reload();
+		if (error)
+			control_printf(client, "error %s\n", error);
+		else
+			control_printf(client, "ok\n");
+		return;
+	}
+	if (strcmp(command, "capture") == 0) {
+		if (!capture_path) {
+			control_printf(client, "error No capture directory set\n");
+			return;
+		}
+		if (argc == 1 && strcmp(argv[0], "on") == 0)
+			capture_enable(true);
+		else if (argc == 1 && strcmp(argv[0], "off") == 0)
+			capture_enable(false);
+		else if (argc == 1 && strcmp(argv[0], "flush") == 0)
+			capture_flush(now, true);
+		else if (argc) {
+			control_printf(client, "error Usage: capture [on|off|flush]\n");
+			return;
+		}
+		control_printf(client, "capture %s\nok\n", capture_on ? "on" : "off");
+		return;
+	}
+	if (strcmp(command, "profile") == 0) {
+		profile_dump(client);
+		for (size_t i = 0; i < interface_count; i ++)
+			interface_profile(interfaces[i].state, now, client);
+		control_printf(client, "ok\n");
+		return;
+	}
+	if (strcmp(command, "history") == 0) {
+		bool all = argc == 0 || (argc == 1 && strcmp(argv[0], "all") == 0);
+		size_t count = all ? interface_count : argc;
+		for (size_t i = 0; i < count; i ++) {
+			int idx = all ? (int)i : interface_idx(argv[i]);
+			if (idx == -1) {
+				control_printf(client, "error Not an active interface %s\n", argv[i]);
+				return;
+			}
+			interface_history(interfaces[idx].state, now, client);
+		}
+		control_printf(client, "ok\n");
+		return;
+	}
+	for (size_t i = 0; i < sizeof interface_commands / sizeof *interface_commands; i ++)
+		if (strcmp(command, interface_commands[i].name) == 0) {
+			control_interfaces(client, interface_commands[i].command, argc, argv);
+			return;
+		}
+	control_printf(client, "error Unknown command %s\n", command);
+}
+
 static void update_now(void) {
 	struct timespec ts;
 	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
@@ -120,6 +326,8 @@ static void update_now(void) {
 static void cleanup(void) {
 	while (interface_count)
 		down(interfaces[0].name);
+	control_cleanup();
+	log_flush(now);
 }
 
 static void cleanup_signal(int unused) {
@@ -128,13 +336,60 @@ static void cleanup_signal(int unused) {
 	_Exit(0);
 }
 
-static int term_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGILL, SIGTRAP, SIGABRT, SIGBUS, SIGFPE, SIGSEGV, SIGPIPE, SIGALRM, SIGTERM };
+static const enum metric_histogram handler_histograms[] = {
+	[MW_FRAME] = MH_HANDLE_FRAME,
+	[MW_NETLINK] = MH_HANDLE_NETLINK,
+	[MW_CONTROL] = MH_HANDLE_CONTROL
+};
+
+// Run the hook of a descriptor and note how long it took
+static void dispatch(struct epoll_tag *tag) {
+	enum metric_wakeup wakeup = tag->wakeup; // The hook may free the tag
+	metric_wakeups[wakeup] ++;
+	uint64_t start = metric_clock();
+	tag->hook(tag);
+	metric_observe(handler_histograms[wakeup], metric_clock() - start);
+}
+
+static struct log_limit overrun_limit;
+
+// Check the loop keeps up
+static void loop_done(uint64_t start) {
+	uint64_t duration = metric_clock() - start;
+	metric_observe(MH_LOOP, duration);
+	if (duration > (uint64_t)loop_budget * 1000) {
+		metric_overruns ++;
+		if (log_enabled(LL_INFO))
+			log_line(&overrun_limit, now, "Main loop", LL_INFO, "iteration took %llu µs, over the budget of %d ms\n", (unsigned long long)duration, loop_budget);
+	}
+}
+
+static volatile sig_atomic_t trace_requested, capture_toggle_requested, reload_requested;
+
+static void trace_signal(int unused) {
+	(void)unused;
+	trace_requested = 1;
+}
+
+static void capture_signal(int unused) {
+	(void)unused;
+	capture_toggle_requested = 1;
+}
+
+static void reload_signal(int unused) {
+	(void)unused;
+	reload_requested = 1;
+}
+
+static int term_signals[] = { SIGINT, SIGQUIT, SIGILL, SIGTRAP, SIGABRT, SIGBUS, SIGFPE, SIGSEGV, SIGPIPE, SIGALRM, SIGTERM };
 
 // We don't care about performance. But multiple events might mean trouble like releasing something and then using it from another event.
 #define MAX_EVENTS 1
 
 int main(int argc, char *argv[]) {
-	openlog("smrtd", 0, LOG_DAEMON);
+	log_init("smrtd");
+	// The random numbers are used to spread the timeouts of interfaces, they need to differ between runs and routers
+	srandom(time(NULL) ^ getpid());
 	// Clean up files and interfaces when exiting, either normally or by a signal
 	for (size_t i = 0; i < sizeof term_signals / sizeof *term_signals; i ++) {
 		struct sigaction action = {
@@ -145,6 +400,25 @@ int main(int argc, char *argv[]) {
 			die("Couldn't set signal %d: %s\n", term_signals[i], strerror(errno));
 	}
 	atexit(cleanup);
+	// Dump the event trace on request (from the main loop, not the handler)
+	struct sigaction trace_action = {
+		.sa_handler = trace_signal,
+		.sa_flags = SA_RESTART
+	};
+	if (sigaction(SIGUSR1, &trace_action, NULL) == -1)
+		die("Couldn't set signal %d: %s\n", SIGUSR1, strerror(errno));
+	struct sigaction capture_action = {
+		.sa_handler = capture_signal,
+		.sa_flags = SA_RESTART
+	};
+	if (sigaction(SIGUSR2, &capture_action, NULL) == -1)
+		die("Couldn't set signal %d: %s\n", SIGUSR2, strerror(errno));
+	struct sigaction reload_action = {
+		.sa_handler = reload_signal,
+		.sa_flags = SA_RESTART
+	};
+	if (sigaction(SIGHUP, &reload_action, NULL) == -1)
+		die("Couldn't set signal %d: %s\n", SIGHUP, strerror(errno));
 	// Initialize epoll
 	poller = epoll_create(42 /* Man mandates this to be positive but otherwise without meaning */);
 	if (poller == -1)
@@ -153,7 +427,8 @@ int main(int argc, char *argv[]) {
 	struct epoll_tag netlink_epoll = {
 		.hook = netlink_ready,
 		.fd = netlink_init(),
-		.name = "Netlink"
+		.name = "Netlink",
+		.wakeup = MW_NETLINK
 	};
 	struct epoll_event netlink_event = {
 		.events = EPOLLIN,
@@ -165,11 +440,30 @@ int main(int argc, char *argv[]) {
 	netstate_init();
 	netstate_set_hooks(up, down);
 	configure(argc, argv);
+	netlink_set_hooks(discovered, removed);
+	if (shm_path)
+		shm_init(shm_path);
+	// Record the frames from the start, if there's where to
+	capture_enable(true);
+	struct epoll_tag control_epoll = {
+		.hook = control_connection,
+		.name = "Control",
+		.wakeup = MW_CONTROL
+	};
+	if (control_path) {
+		control_epoll.fd = control_init(control_path, control_command);
+		struct epoll_event control_event = {
+			.events = EPOLLIN,
+			.data.ptr = &control_epoll
+		};
+		if (epoll_ctl(poller, EPOLL_CTL_ADD, control_epoll.fd, &control_event) == -1)
+			die("Couldn't insert control socket into epoll: %s\n", strerror(errno));
+	}
+	update_now();
 	netstate_update();
 
 	// Run the loop. Forever.
 	dbg("Init done\n");
-	update_now();
 	for (;;) {
 		TICK:;
 		int timeout = -1;
@@ -179,27 +473,67 @@ int main(int argc, char *argv[]) {
 			if (timeout == -1 || (it != -1 && it < timeout))
 				timeout = it;
 		}
+		// Hand the queued messages to the syslog. If it doesn't take them all, try again soon.
+		log_flush(now);
+		if (log_pending() && (timeout == -1 || timeout > LOG_RETRY))
+			timeout = LOG_RETRY;
+		// Write the captured frames that waited long enough
+		capture_flush(now, false);
+		if (capture_pending() && (timeout == -1 || timeout > CAPTURE_DELAY))
+			timeout = CAPTURE_DELAY;
 		struct epoll_event events[MAX_EVENTS];
 		dbg("Epoll wait with %d ms timeout\n", timeout);
 		int events_read = epoll_wait(poller, events, MAX_EVENTS, timeout);
 		update_now();
+		uint64_t loop_start = metric_clock();
 		dbg("Epoll tick\n");
+		if (trace_requested) {
+			trace_requested = 0;
+			const char *error = trace_dump(trace_path);
+			if (error)
+				error_msg("Couldn't dump the trace to %s: %s\n", trace_path, error);
+		}
+		if (capture_toggle_requested) {
+			capture_toggle_requested = 0;
+			capture_enable(!capture_on);
+		}
+		if (reload_requested) {
+			reload_requested = 0;
+			const char *error = reload();
+			if (error)
+				error_msg("Couldn't reload the configuration: %s\n", error);
+			// The interfaces may have changed a lot, compute the timeouts again
+			goto TICK;
+		}
 		if (events_read == -1) {
-			if (errno == EINTR)
+			if (errno == EINTR) {
+				metric_wakeups[MW_SIGNAL] ++;
 				continue;
+			}
 			die("Error waiting for epoll: %s\n", strerror(errno));
 		}
+		if (!events_read)
+			metric_wakeups[MW_TIMEOUT] ++;
 		for (int i = 0; i < events_read; i ++) {
 			struct epoll_tag *t = events[i].data.ptr;
+			if (t->own_errors) {
+				dispatch(t);
+				continue;
+			}
 			if (events[i].events & EPOLLERR) {
 				int error = 0;
 				socklen_t errlen = sizeof error;
 				if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen) == -1)
-					msg("Error getting error on file descriptor %d/%s: %s\n", t->fd, t->name, strerror(errno));
-				if (t->fd == netlink_epoll.fd)
-					die("Error on netlink descriptor %d: %s\n", t->fd, strerror(error));
-				else {
-					msg("Error on interface file descriptor %d/%s: %s, bringing down\n", t->fd, t->name, strerror(error));
+					error_msg("Error getting error on file descriptor %d/%s: %s\n", t->fd, t->name, strerror(errno));
+				if (t->fd == netlink_epoll.fd) {
+					if (error != ENOBUFS)
+						die("Error on netlink descriptor %d: %s\n", t->fd, strerror(error));
+					// Too many events at once (many interfaces changing), some got lost. Look at all the interfaces.
+					msg("Netlink events lost, checking all the interfaces\n");
+					netstate_update();
+					goto TICK;
+				} else {
+					error_msg("Error on interface file descriptor %d/%s: %s, bringing down\n", t->fd, t->name, strerror(error));
 					netstate_down(t->name);
 					down(t->name);
 					// Try sniffing the interfaces, the state might be wrong
@@ -208,11 +542,19 @@ int main(int argc, char *argv[]) {
 				}
 			}
 			if (events[i].events & EPOLLIN)
-				t->hook(t);
+				dispatch(t);
 		}
-		// Timeouts
+		/*
+		 * Timeouts. Handle all the interfaces that are due, even if they
+		 * still have some slack left ‒ we are awake anyway, so this saves
+		 * a wakeup later.
+		 */
 		for (size_t i = 0; i < interface_count; i ++)
-			if (interface_timeout(interfaces[i].state, now) <= 0)
+			if (interface_due(interfaces[i].state, now)) {
+				uint64_t start = metric_clock();
 				interface_tick(interfaces[i].state, now);
+				metric_observe(MH_HANDLE_TICK, metric_clock() - start);
+			}
+		loop_done(loop_start);
 	}
 }
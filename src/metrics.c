@@ -0,0 +1,153 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "control.h"
+#include "upload.h"
+
+#include <stdio.h>
+
+uint64_t metric_totals[MC_COUNT];
+uint64_t metric_wakeups[MW_COUNT];
+uint64_t metric_overruns;
+
+static const char *const wakeup_names[] = {
+	[MW_TIMEOUT] = "timeout",
+	[MW_FRAME] = "frame",
+	[MW_NETLINK] = "netlink",
+	[MW_CONTROL] = "control",
+	[MW_SIGNAL] = "signal"
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_defs[] = {
+	[MC_FRAMES_SENT] = { "frames_sent", "Frames sent to the modems" },
+	[MC_FRAMES_RECEIVED] = { "frames_received", "Frames received from the modems" },
+	[MC_FOREIGN_FRAMES] = { "foreign_frames", "Frames received and ignored as not coming from a modem" },
+	[MC_RETRANSMITS] = { "retransmits", "Requests sent again after no answer came" },
+	[MC_TIMEOUTS] = { "timeouts", "Timeouts after all the retransmits" },
+	[MC_RESETS] = { "resets", "Resets of the modems" },
+	[MC_DEAD] = { "dead", "Times no modem was found" },
+	[MC_UPLOADS_STARTED] = { "uploads_started", "Firmware uploads started" },
+	[MC_UPLOADS_COMPLETED] = { "uploads_completed", "Firmware uploads completed" },
+	[MC_UPLOAD_BYTES] = { "upload_bytes", "Bytes of firmware acknowledged by the modems" },
+	[MC_TRANSITIONS] = { "transitions", "State changes of the automaton" }
+};
+
+struct histogram_def {
+	const char *name;
+	const char *help;
+	size_t bound_count;
+	uint64_t bounds[HISTOGRAM_MAX_BOUNDS];
+};
+
+// Bounds of the histograms of execution times
+#define MICROSECONDS 13, { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000 }
+
+static const struct histogram_def histogram_defs[] = {
+	[MH_RTT] = { "rtt_milliseconds", "Time between a request and its answer", 10, { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 } },
+	[MH_TIME_TO_ONLINE] = { "time_to_online_seconds", "Time from finding the modem until the line is online", 10, { 10, 20, 30, 60, 90, 120, 180, 300, 600, 1200 } },
+	[MH_UPLOAD_SPEED] = { "upload_bytes_per_second", "Speed of whole firmware uploads", 9, { 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000 } },
+	[MH_TIMER_LATENESS] = { "timer_lateness_milliseconds", "How late the interface timers fire after their deadline (early ones count as 0)", 11, { 0, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 } },
+	[MH_HANDLE_TICK] = { "handle_tick_microseconds", "Time spent handling an interface timeout", MICROSECONDS },
+	[MH_HANDLE_FRAME] = { "handle_frame_microseconds", "Time spent handling a received frame", MICROSECONDS },
+	[MH_HANDLE_NETLINK] = { "handle_netlink_microseconds", "Time spent handling a netlink event", MICROSECONDS },
+	[MH_HANDLE_CONTROL] = { "handle_control_microseconds", "Time spent handling the control socket", MICROSECONDS },
+	[MH_STATUS_WRITE] = { "status_write_microseconds", "Time spent writing a status file", MICROSECONDS },
+	[MH_LOOP] = { "loop_iteration_microseconds", "Time of one iteration of the main loop, without waiting", MICROSECONDS }
+};
+
+static struct histogram histograms[MH_COUNT];
+static struct metrics *registered;
+
+void metric_observe(enum metric_histogram histogram, uint64_t value) {
+	const struct histogram_def *def = &histogram_defs[histogram];
+	struct histogram *h = &histograms[histogram];
+	size_t i = 0;
+	while (i < def->bound_count && value > def->bounds[i])
+		i ++;
+	h->buckets[i] ++;
+	h->sum += value;
+	h->count ++;
+}
+
+void metrics_register(struct metrics *metrics, const char *ifname) {
+	metrics->ifname = ifname;
+	metrics->prev = NULL;
+	metrics->next = registered;
+	if (registered)
+		registered->prev = metrics;
+	registered = metrics;
+}
+
+void metrics_unregister(struct metrics *metrics) {
+	if (metrics->prev)
+		metrics->prev->next = metrics->next;
+	else
+		registered = metrics->next;
+	if (metrics->next)
+		metrics->next->prev = metrics->prev;
+}
+
+static void header(struct control_client *client, const char *name, const char *help, const char *type) {
+	control_printf(client, "# HELP smrtd_%s %s\n# TYPE smrtd_%s %s\n", name, help, name, type);
+}
+
+void metrics_dump(struct control_client *client) {
+	size_t interface_count = 0;
+	for (const struct metrics *m = registered; m; m = m->next)
+		interface_count ++;
+	header(client, "interfaces", "Interfaces being watched for modems", "gauge");
+	control_printf(client, "smrtd_interfaces %zu\n", interface_count);
+	header(client, "uploads_active", "Firmware uploads running now", "gauge");
+	control_printf(client, "smrtd_uploads_active %u\n", upload_active_count());
+	header(client, "upload_limit", "Current limit on concurrent firmware uploads", "gauge");
+	control_printf(client, "smrtd_upload_limit %u\n", upload_limit());
+	header(client, "wakeups_total", "Wakeups of the main loop by their cause", "counter");
+	for (size_t w = 0; w < MW_COUNT; w ++)
+		control_printf(client, "smrtd_wakeups_total{cause=\"%s\"} %llu\n", wakeup_names[w], (unsigned long long)metric_wakeups[w]);
+	header(client, "loop_overruns_total", "Iterations of the main loop longer than the budget", "counter");
+	control_printf(client, "smrtd_loop_overruns_total %llu\n", (unsigned long long)metric_overruns);
+	header(client, "interface_automaton_state", "State of the automaton of the interface", "gauge");
+	for (const struct metrics *m = registered; m; m = m->next)
+		control_printf(client, "smrtd_interface_automaton_state{interface=\"%s\"} %u\n", m->ifname, m->state);
+	for (size_t c = 0; c < MC_COUNT; c ++) {
+		char name[64];
+		snprintf(name, sizeof name, "%s_total", counter_defs[c].name);
+		header(client, name, counter_defs[c].help, "counter");
+		control_printf(client, "smrtd_%s %llu\n", name, (unsigned long long)metric_totals[c]);
+		snprintf(name, sizeof name, "interface_%s_total", counter_defs[c].name);
+		header(client, name, counter_defs[c].help, "counter");
+		for (const struct metrics *m = registered; m; m = m->next)
+			control_printf(client, "smrtd_%s{interface=\"%s\"} %llu\n", name, m->ifname, (unsigned long long)m->counters[c]);
+	}
+	for (size_t h = 0; h < MH_COUNT; h ++) {
+		const struct histogram_def *def = &histogram_defs[h];
+		const struct histogram *hist = &histograms[h];
+		header(client, def->name, def->help, "histogram");
+		uint64_t cumulative = 0;
+		for (size_t b = 0; b < def->bound_count; b ++) {
+			cumulative += hist->buckets[b];
+			control_printf(client, "smrtd_%s_bucket{le=\"%llu\"} %llu\n", def->name, (unsigned long long)def->bounds[b], (unsigned long long)cumulative);
+		}
+		control_printf(client, "smrtd_%s_bucket{le=\"+Inf\"} %llu\n", def->name, (unsigned long long)hist->count);
+		control_printf(client, "smrtd_%s_sum %llu\nsmrtd_%s_count %llu\n", def->name, (unsigned long long)hist->sum, def->name, (unsigned long long)hist->count);
+	}
+}
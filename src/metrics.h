@@ -0,0 +1,128 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_METRICS_H
+#define SMRT_METRICS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Counters and histograms describing how the daemon performs. Updating them
+ * is just few additions, so they can be used on the hot paths. They are
+ * exported in the Prometheus text format.
+ */
+
+enum metric_counter {
+	MC_FRAMES_SENT,
+	MC_FRAMES_RECEIVED,
+	MC_FOREIGN_FRAMES,
+	MC_RETRANSMITS,
+	MC_TIMEOUTS,
+	MC_RESETS,
+	MC_DEAD,
+	MC_UPLOADS_STARTED,
+	MC_UPLOADS_COMPLETED,
+	MC_UPLOAD_BYTES,
+	MC_TRANSITIONS,
+	MC_COUNT
+};
+
+// Upper bounds of the buckets, the last one is implicitly infinity
+#define HISTOGRAM_MAX_BOUNDS 15
+
+enum metric_histogram {
+	// Time between sending a request and getting an answer to it (ms)
+	MH_RTT,
+	// Time from starting to initialize the modem until it is online (s)
+	MH_TIME_TO_ONLINE,
+	// Speed of the whole firmware upload (bytes/s)
+	MH_UPLOAD_SPEED,
+	// How late the interface timers fire after their deadline (ms)
+	MH_TIMER_LATENESS,
+	// Execution times of the main loop handlers (µs)
+	MH_HANDLE_TICK,
+	MH_HANDLE_FRAME,
+	MH_HANDLE_NETLINK,
+	MH_HANDLE_CONTROL,
+	// Writing of a status file (µs)
+	MH_STATUS_WRITE,
+	// One iteration of the main loop, without the waiting (µs)
+	MH_LOOP,
+	MH_COUNT
+};
+
+struct histogram {
+	uint64_t buckets[HISTOGRAM_MAX_BOUNDS + 1];
+	uint64_t sum, count;
+};
+
+// Metrics of one interface
+struct metrics {
+	uint64_t counters[MC_COUNT];
+	// The automaton state, as a gauge
+	unsigned state;
+	const char *ifname;
+	struct metrics *next, *prev;
+};
+
+// Totals over all the interfaces, including the ones no longer present
+extern uint64_t metric_totals[MC_COUNT];
+
+// Why the main loop woke up
+enum metric_wakeup {
+	MW_TIMEOUT,
+	MW_FRAME,
+	MW_NETLINK,
+	MW_CONTROL,
+	MW_SIGNAL,
+	MW_COUNT
+};
+
+extern uint64_t metric_wakeups[MW_COUNT];
+// Iterations of the main loop that took longer than the budget
+extern uint64_t metric_overruns;
+
+// Monotonic time in microseconds, for measuring how long something takes
+static inline uint64_t metric_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static inline void metric_add(struct metrics *metrics, enum metric_counter counter, uint64_t value) {
+	metrics->counters[counter] += value;
+	metric_totals[counter] += value;
+}
+
+static inline void metric_inc(struct metrics *metrics, enum metric_counter counter) {
+	metric_add(metrics, counter, 1);
+}
+
+void metric_observe(enum metric_histogram histogram, uint64_t value);
+
+// Start exporting metrics of an interface
+void metrics_register(struct metrics *metrics, const char *ifname);
+void metrics_unregister(struct metrics *metrics);
+
+struct control_client;
+// Write all the metrics into the control answer
+void metrics_dump(struct control_client *client);
+
+#endif
@@ -0,0 +1,349 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "modem.h"
+#include "fault.h"
+#include "proto_const.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+// The layout of the messages, as the modem sees them
+
+struct param_header {
+	uint8_t cmd;
+	uint16_t len;
+	uint16_t seq;
+	uint32_t param;
+} __attribute__((packed));
+
+struct param_ack {
+	uint8_t cmd;
+	uint16_t len;
+	uint16_t seq;
+	uint8_t error;
+} __attribute__((packed));
+
+struct pm_answer {
+	struct param_header header;
+	uint32_t value;
+} __attribute__((packed));
+
+struct version_answer {
+	struct param_header header;
+	char fw[20];
+	char dsp[20];
+} __attribute__((packed));
+
+struct status_answer {
+	struct param_header header;
+	uint8_t annex;
+	uint8_t standard;
+	uint8_t state;
+	uint8_t power;
+	uint8_t data_path;
+	uint32_t dsmax;
+	uint32_t usmax;
+	uint32_t dscur;
+	uint32_t uscur;
+	uint16_t dspower;
+	uint16_t uspower;
+} __attribute__((packed));
+
+struct file_offer {
+	uint8_t cmd;
+	uint8_t findex;
+	uint32_t fsize;
+	uint8_t ftype;
+} __attribute__((packed));
+
+struct image_part {
+	uint8_t cmd;
+	uint32_t offset;
+	uint32_t size;
+	uint8_t data[];
+} __attribute__((packed));
+
+struct img_ack {
+	uint8_t cmd;
+	uint32_t status;
+} __attribute__((packed));
+
+// Annex A, G992_5
+#define EMU_ANNEX 1
+#define EMU_STANDARD 5
+
+void modem_init(struct modem *modem, const struct modem_config *config, uint64_t now) {
+	*modem = (struct modem) {
+		.config = config,
+		.phase = config->preloaded ? MP_RUNNING : MP_BOOT,
+		.boot_until = config->preloaded ? now : now + config->boot_time,
+		.refuse_offers = config->refuse_offers,
+		.wrong_versions = config->wrong_versions,
+		.stuck_trainings = config->stuck_trainings
+	};
+}
+
+enum modem_line_state modem_line_state(const struct modem *modem, uint64_t now) {
+	if (modem->phase != MP_RUNNING || !modem->link_enabled)
+		return ML_IDLE;
+	uint64_t up = now - modem->link_since;
+	if (up < modem->config->handshake_time)
+		return ML_HANDSHAKE;
+	if (modem->stuck || up < (uint64_t)modem->config->handshake_time + modem->config->training_time)
+		return ML_TRAINING;
+	return ML_ONLINE;
+}
+
+static size_t answer_header(uint8_t *answer, const struct param_header *request, size_t size) {
+	struct param_header *header = (struct param_header *)answer;
+	*header = (struct param_header) {
+		.cmd = CMD_ANSWER_PARAM,
+		.len = htons(size - 5),
+		.seq = request->seq,
+		.param = request->param
+	};
+	return size;
+}
+
+static size_t get_param(struct modem *modem, uint64_t now, const struct param_header *request, uint8_t *answer) {
+	switch (ntohl(request->param)) {
+		case PARAM_PM: {
+			// Available even without the firmware
+			struct pm_answer *a = (struct pm_answer *)answer;
+			a->value = 0;
+			return answer_header(answer, request, sizeof *a);
+		}
+		case PARAM_VERSION: {
+			if (modem->phase != MP_RUNNING)
+				return 0;
+			struct version_answer *a = (struct version_answer *)answer;
+			memset(a->fw, 0, sizeof a->fw);
+			if (modem->wrong_versions) {
+				modem->wrong_versions --;
+				strncpy(a->fw, "wrong", sizeof a->fw - 1);
+			} else
+				strncpy(a->fw, modem->config->version, sizeof a->fw - 1);
+			memset(a->dsp, 0, sizeof a->dsp);
+			strncpy(a->dsp, "emulated", sizeof a->dsp - 1);
+			return answer_header(answer, request, sizeof *a);
+		}
+		case PARAM_STATUS: {
+			if (modem->phase != MP_RUNNING)
+				return 0;
+			struct status_answer *a = (struct status_answer *)answer;
+			enum modem_line_state state = modem_line_state(modem, now);
+			const struct modem_config *c = modem->config;
+			bool online = state == ML_ONLINE;
+			if (online && !modem->online_at)
+				modem->online_at = now;
+			*a = (struct status_answer) {
+				.annex = EMU_ANNEX,
+				.standard = EMU_STANDARD,
+				.state = state,
+				.data_path = online,
+				.dsmax = htonl(online ? c->dsmax : 0),
+				.usmax = htonl(online ? c->usmax : 0),
+				.dscur = htonl(online ? c->dscur : 0),
+				.uscur = htonl(online ? c->uscur : 0),
+				.dspower = htons(online ? c->dspower : 0),
+				.uspower = htons(online ? c->uspower : 0)
+			};
+			return answer_header(answer, request, sizeof *a);
+		}
+		default:
+			return 0;
+	}
+}
+
+static size_t set_param(struct modem *modem, uint64_t now, const struct param_header *request, size_t size, uint8_t *answer) {
+	uint32_t param = ntohl(request->param);
+	if (param == PARAM_RESET) {
+		// It reboots and loses the firmware, there's no answer
+		modem->phase = MP_BOOT;
+		modem->boot_until = now + modem->config->boot_time;
+		modem->link_enabled = false;
+		modem->resets ++;
+		return 0;
+	}
+	if (modem->phase != MP_RUNNING)
+		return 0;
+	if (param == PARAM_LINK && size > sizeof *request) {
+		bool enable = ((const uint8_t *)request)[sizeof *request];
+		if (enable && !modem->link_enabled) {
+			modem->link_since = now;
+			modem->stuck = modem->stuck_trainings;
+			if (modem->stuck)
+				modem->stuck_trainings --;
+		}
+		modem->link_enabled = enable;
+	} else if (param != PARAM_MODE && (param < PARAM_CONN || param >= PARAM_CONN + 8))
+		return 0; // Not something we know
+	struct param_ack *ack = (struct param_ack *)answer;
+	*ack = (struct param_ack) {
+		.cmd = CMD_PARAM_ACK,
+		.len = htons(1),
+		.seq = request->seq
+	};
+	return sizeof *ack;
+}
+
+static size_t image_ack(uint8_t *answer, uint32_t status) {
+	struct img_ack *ack = (struct img_ack *)answer;
+	*ack = (struct img_ack) {
+		.cmd = CMD_IMG_ACK,
+		.status = htonl(status)
+	};
+	return sizeof *ack;
+}
+
+size_t modem_input(struct modem *modem, uint64_t now, const uint8_t *input, size_t size, uint8_t *answer) {
+	if (!modem->first_seen)
+		modem->first_seen = now;
+	if (now < modem->boot_until || !size)
+		return 0;
+	switch (input[0]) {
+		case CMD_GET_PARAM:
+			if (size < sizeof(struct param_header))
+				return 0;
+			return get_param(modem, now, (const struct param_header *)input, answer);
+		case CMD_SET_PARAM:
+			if (size < sizeof(struct param_header))
+				return 0;
+			return set_param(modem, now, (const struct param_header *)input, size, answer);
+		case CMD_OFFER_IMAGE: {
+			// A running modem doesn't want another firmware, it ignores the offer
+			if (size < sizeof(struct file_offer) || modem->phase == MP_RUNNING)
+				return 0;
+			const struct file_offer *offer = (const struct file_offer *)input;
+			modem->offers ++;
+			if (modem->refuse_offers) {
+				modem->refuse_offers --;
+				return image_ack(answer, 0);
+			}
+			modem->phase = MP_LOADING;
+			modem->image_size = ntohl(offer->fsize);
+			modem->image_received = 0;
+			return image_ack(answer, IMG_PROCEED);
+		}
+		case CMD_IMG_DATA: {
+			if (size < sizeof(struct image_part) || modem->phase != MP_LOADING)
+				return 0;
+			const struct image_part *part = (const struct image_part *)input;
+			uint32_t offset = ntohl(part->offset), part_size = ntohl(part->size);
+			if (part_size > modem->config->max_part || part_size > size - sizeof *part)
+				return 0; // Too large for us, it gets lost
+			// A part we already have (the ack got lost) is just acknowledged again
+			if (offset == modem->image_received)
+				modem->image_received += part_size;
+			if (modem->image_received >= modem->image_size) {
+				modem->phase = MP_RUNNING;
+				modem->link_enabled = false;
+				modem->uploads ++;
+				return image_ack(answer, IMG_COMPLETE);
+			}
+			return image_ack(answer, modem->image_received);
+		}
+		default:
+			return 0;
+	}
+}
+
+const struct modem_config modem_config_default = {
+	.version = "emulated",
+	.boot_time = 100,
+	.handshake_time = 1000,
+	.training_time = 5000,
+	.max_part = MAX_DATA_PAYLOAD,
+	.dsmax = 24000,
+	.usmax = 1200,
+	.dscur = 20000,
+	.uscur = 1000,
+	.dspower = 180,
+	.uspower = 120
+};
+
+int modem_option_number(const char *arg) {
+	char *end;
+	long result = strtol(arg, &end, 10);
+	if (!*arg || *end || result < 0)
+		die("%s is not a valid number\n", arg);
+	return result;
+}
+
+static void modem_fault(struct modem_config *config, const char *spec) {
+	const char *eq = strchr(spec, '=');
+	size_t len = eq ? (size_t)(eq - spec) : strlen(spec);
+	unsigned count = eq ? modem_option_number(eq + 1) : 1;
+	if (len == strlen("refuse-offer") && strncmp(spec, "refuse-offer", len) == 0)
+		config->refuse_offers = count;
+	else if (len == strlen("wrong-version") && strncmp(spec, "wrong-version", len) == 0)
+		config->wrong_versions = count;
+	else if (len == strlen("stuck-training") && strncmp(spec, "stuck-training", len) == 0)
+		config->stuck_trainings = count;
+	else
+		die("Unknown modem fault %s\n", spec);
+}
+
+bool modem_option(int option, const char *arg, struct modem_config *config, uint64_t *seed) {
+	switch (option) {
+		case 'B':
+			config->boot_time = modem_option_number(arg);
+			return true;
+		case 'H':
+			config->handshake_time = modem_option_number(arg);
+			return true;
+		case 't':
+			config->training_time = modem_option_number(arg);
+			return true;
+		case 'p':
+			config->max_part = modem_option_number(arg);
+			return true;
+		case 's':
+			*seed = modem_option_number(arg);
+			return true;
+		case 'f':
+			if (!fault_rule(arg))
+				die("Invalid fault %s\n", arg);
+			return true;
+		case 'x':
+			modem_fault(config, arg);
+			return true;
+		case 'W':
+			config->preloaded = true;
+			return true;
+		default:
+			return false;
+	}
+}
+
+static int u64_cmp(const void *a, const void *b) {
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+	return (ua > ub) - (ua < ub);
+}
+
+void modem_result(size_t modems, uint64_t *times, size_t online) {
+	printf("result modems=%zu online=%zu", modems, online);
+	if (online) {
+		qsort(times, online, sizeof *times, u64_cmp);
+		printf(" min=%llu p50=%llu p90=%llu p99=%llu max=%llu", (unsigned long long)times[0], (unsigned long long)times[online / 2], (unsigned long long)times[online * 9 / 10], (unsigned long long)times[online * 99 / 100], (unsigned long long)times[online - 1]);
+	}
+	putchar('\n');
+}
@@ -0,0 +1,118 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_MODEM_H
+#define SMRT_MODEM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Model of the modem, for testing the daemon without the real hardware. It
+ * only works with the payloads of the frames and the time is given from
+ * outside, so it may run over real interfaces as well as in a simulation.
+ */
+
+// What the modem is like
+struct modem_config {
+	// The version it reports once running the firmware
+	const char *version;
+	// Time after a reset when it doesn't answer anything (ms)
+	unsigned boot_time;
+	// How long the line is in handshake and training after enabling the link (ms)
+	unsigned handshake_time, training_time;
+	// The largest image part it accepts (larger ones are ignored)
+	uint32_t max_part;
+	// Speeds (kbit/s) and powers once online
+	uint32_t dsmax, usmax, dscur, uscur;
+	uint16_t dspower, uspower;
+	// Scripted faults: refuse this many offers, report a wrong version this many times, get stuck in training this many times
+	unsigned refuse_offers, wrong_versions, stuck_trainings;
+	// It already runs the firmware when started (like when only the daemon restarted)
+	bool preloaded;
+};
+
+enum modem_phase {
+	// Without the firmware, waiting for an offer
+	MP_BOOT,
+	// Receiving the firmware
+	MP_LOADING,
+	// The firmware is running
+	MP_RUNNING
+};
+
+struct modem {
+	const struct modem_config *config;
+	enum modem_phase phase;
+	// Until when it is booting and deaf (ms)
+	uint64_t boot_until;
+	uint32_t image_size, image_received;
+	bool link_enabled;
+	uint64_t link_since;
+	// The scripted faults still to happen
+	unsigned refuse_offers, wrong_versions, stuck_trainings;
+	// The training never ends this time
+	bool stuck;
+	// Statistics
+	unsigned offers, resets, uploads;
+	// When the daemon first talked to it and when it first reported being online (0 if not yet)
+	uint64_t first_seen, online_at;
+};
+
+// Line states as reported in the status
+enum modem_line_state {
+	ML_IDLE,
+	ML_HANDSHAKE,
+	ML_TRAINING,
+	ML_ONLINE
+};
+
+void modem_init(struct modem *modem, const struct modem_config *config, uint64_t now);
+/*
+ * Handle a frame payload from the daemon. The answer, if any, is written
+ * into the answer buffer (which must have at least MODEM_ANSWER_MAX bytes)
+ * and its size is returned. 0 means no answer.
+ */
+size_t modem_input(struct modem *modem, uint64_t now, const uint8_t *input, size_t size, uint8_t *answer);
+// The state of the line as it would be reported now
+enum modem_line_state modem_line_state(const struct modem *modem, uint64_t now);
+
+#define MODEM_ANSWER_MAX 128
+
+// What the emulated modems are like unless the options say otherwise
+extern const struct modem_config modem_config_default;
+
+/*
+ * The options the emulator and the simulator share (the modem config, the
+ * seed and the faults), for getopt and for the usage message.
+ */
+#define MODEM_OPTIONS "B:H:t:p:s:f:x:W"
+#define MODEM_USAGE "[-B boot_ms] [-H handshake_ms] [-t training_ms] [-p max_part] [-s seed] [-f kind:message:probability[:max_delay_ms]]... [-x refuse-offer|wrong-version|stuck-training[=count]]... [-W]"
+// Handle one of MODEM_OPTIONS. Returns false if it is not one of them, dies on an invalid value.
+bool modem_option(int option, const char *arg, struct modem_config *config, uint64_t *seed);
+// A non-negative number from the command line. Dies if it's not one.
+int modem_option_number(const char *arg);
+/*
+ * Print the result line, for the scripts to pick up: the number of modems,
+ * how many got online and the distribution of the times it took them (ms,
+ * they get sorted).
+ */
+void modem_result(size_t modems, uint64_t *times, size_t online);
+
+#endif
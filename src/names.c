@@ -0,0 +1,50 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The names of the automaton states. Separate from the automaton, so the tools can use them.
+
+#include "automaton.h"
+
+static const char *const state_names[] = {
+	[AS_PRESTART] = "prestart",
+	[AS_ASKED_PRESENT] = "asked_present",
+	[AS_UPLOAD_WAIT] = "upload_wait",
+	[AS_ASKED_WANT_IMAGE] = "asked_want_image",
+	[AS_SEND_FIRMWARE] = "send_firmware",
+	[AS_ASKED_VERSION] = "asked_version",
+	[AS_WAIT_BEFORE_CONFIG] = "wait_before_config",
+	[AS_SEND_CONFIG_MODE] = "send_config_mode",
+	[AS_SEND_CONFIG_CONN] = "send_config_conn",
+	[AS_WAIT_CONFIG] = "wait_config",
+	[AS_ENABLE_LINK] = "enable_link",
+	[AS_FIRST_START] = "first_start",
+	[AS_ALLOW_ALL] = "allow_all",
+	[AS_ALL_START] = "all_start",
+	[AS_WATCH] = "watch",
+	[AS_CONFIRM_WORKING] = "confirm_working",
+	[AS_RESET] = "reset",
+	[AS_DEAD] = "dead",
+	[AS_RECONFIG] = "reconfig",
+	[AS_INVALID_IMAGE] = "invalid_image"
+};
+
+const char *autom_state_name(enum autom_state state) {
+	if (state < sizeof state_names / sizeof *state_names && state_names[state])
+		return state_names[state];
+	return "unknown";
+}
@@ -51,6 +51,9 @@ void netstate_init(void) {
 }
 
 void netstate_add(const char *name) {
+	for (size_t i = 0; i < interface_count; i ++)
+		if (strcmp(interfaces[i].name, name) == 0)
+			return; // Already watched
 	dbg("Watching for interface %s\n", name);
 	interfaces = realloc(interfaces, (++ interface_count) * sizeof *interfaces);
 	interfaces[interface_count - 1] = (struct interface) {
@@ -85,6 +88,31 @@ void netstate_set_hooks(link_hook up, link_hook down) {
 	down_hook = down;
 }
 
+void netstate_prune(netstate_keep keep) {
+	size_t kept = 0;
+	for (size_t i = 0; i < interface_count; i ++) {
+		if (keep(interfaces[i].name)) {
+			interfaces[kept ++] = interfaces[i];
+			continue;
+		}
+		dbg("No longer watching interface %s\n", interfaces[i].name);
+		iflink(i, false);
+		free((char *)interfaces[i].name);
+	}
+	interface_count = kept;
+}
+
+void netstate_remove(const char *name) {
+	for (size_t i = 0; i < interface_count; i ++)
+		if (strcmp(name, interfaces[i].name) == 0) {
+			dbg("No longer watching interface %s\n", name);
+			iflink(i, false);
+			free((char *)interfaces[i].name);
+			interfaces[i] = interfaces[-- interface_count];
+			return;
+		}
+}
+
 void netstate_down(const char *name) {
 	for (size_t i = 0; i < interface_count; i ++)
 		if (strcmp(name, interfaces[i].name) == 0) {
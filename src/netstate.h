@@ -19,12 +19,19 @@
 #ifndef SMRT_NETSTATE_H
 #define SMRT_NETSTATE_H
 
+#include <stdbool.h>
+
 // Initialize the module.
 void netstate_init(void);
 // Scan the interfaces and look if there's any change in the link state
 void netstate_update(void);
-// Add another interface to be watched (if it exists)
+// Add another interface to be watched (if it exists). Adding one already watched does nothing.
 void netstate_add(const char *name);
+// Stop watching the interfaces keep says no to. The ones that are up go down first.
+typedef bool (*netstate_keep)(const char *name);
+void netstate_prune(netstate_keep keep);
+// Stop watching the interface (it goes down first if it is up). Removing one not watched does nothing.
+void netstate_remove(const char *name);
 // Mark the interface as down externally
 void netstate_down(const char *name);
 
@@ -0,0 +1,83 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+#include "control.h"
+
+// Upper bounds of the dwell time buckets (ms), the last one is infinity
+static const uint64_t bounds[] = { 10, 50, 100, 500, 1000, 5000, 10000, 30000, 60000, 300000 };
+#define BUCKETS (sizeof bounds / sizeof *bounds + 1)
+
+struct dwell {
+	uint64_t buckets[BUCKETS];
+	uint64_t count, total, max;
+};
+
+struct edge {
+	uint64_t count, total;
+};
+
+static struct dwell dwells[AS_COUNT];
+static struct edge edges[AS_COUNT][AS_COUNT];
+
+void profile_transition(struct profile *profile, enum autom_state from, enum autom_state to, uint64_t now) {
+	// The time of entering the previous state is unknown for the very first one
+	if (profile->entered[from]) {
+		uint64_t time = now - profile->entered[from];
+		struct dwell *d = &dwells[from];
+		size_t b = 0;
+		while (b < BUCKETS - 1 && time > bounds[b])
+			b ++;
+		d->buckets[b] ++;
+		d->count ++;
+		d->total += time;
+		if (time > d->max)
+			d->max = time;
+		edges[from][to].count ++;
+		edges[from][to].total += time;
+	}
+	profile->entered[to] = now;
+}
+
+void profile_dump(struct control_client *client) {
+	control_printf(client, "# state entries total_ms avg_ms max_ms buckets(");
+	for (size_t b = 0; b < BUCKETS - 1; b ++)
+		control_printf(client, "<=%llu ", (unsigned long long)bounds[b]);
+	control_printf(client, "more)\n");
+	for (size_t s = 0; s < AS_COUNT; s ++) {
+		const struct dwell *d = &dwells[s];
+		if (!d->count)
+			continue;
+		control_printf(client, "state %s %llu %llu %llu %llu", autom_state_name(s), (unsigned long long)d->count, (unsigned long long)d->total, (unsigned long long)(d->total / d->count), (unsigned long long)d->max);
+		for (size_t b = 0; b < BUCKETS; b ++)
+			control_printf(client, " %llu", (unsigned long long)d->buckets[b]);
+		control_printf(client, "\n");
+	}
+	control_printf(client, "# edge from to count total_ms avg_ms\n");
+	for (size_t from = 0; from < AS_COUNT; from ++)
+		for (size_t to = 0; to < AS_COUNT; to ++) {
+			const struct edge *e = &edges[from][to];
+			if (e->count)
+				control_printf(client, "edge %s %s %llu %llu %llu\n", autom_state_name(from), autom_state_name(to), (unsigned long long)e->count, (unsigned long long)e->total, (unsigned long long)(e->total / e->count));
+		}
+}
+
+void profile_dump_interface(const struct profile *profile, const char *ifname, enum autom_state current, uint64_t now, struct control_client *client) {
+	uint64_t since = profile->entered[current];
+	control_printf(client, "interface %s %s %llu\n", ifname, autom_state_name(current), since ? (unsigned long long)(now - since) : 0ULL);
+}
@@ -0,0 +1,47 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_PROFILE_H
+#define SMRT_PROFILE_H
+
+#include "automaton.h"
+
+#include <stdint.h>
+
+/*
+ * Where the time goes. For each state of the automaton, we keep a histogram
+ * of how long the interfaces stay in it, and for each pair of states how many
+ * times the automaton moved from one to the other and how long it took.
+ */
+
+// Per-interface part
+struct profile {
+	// When the interface entered each of the states the last time (0 if never)
+	uint64_t entered[AS_COUNT];
+};
+
+// The automaton moves from one state to another (maybe the same one)
+void profile_transition(struct profile *profile, enum autom_state from, enum autom_state to, uint64_t now);
+
+struct control_client;
+// Write the summary into the control answer
+void profile_dump(struct control_client *client);
+// Write the per-interface part into the control answer
+void profile_dump_interface(const struct profile *profile, const char *ifname, enum autom_state current, uint64_t now, struct control_client *client);
+
+#endif
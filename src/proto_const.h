@@ -51,5 +51,9 @@
 
 // This fits into the ethernet MTU (1500) and is number divisible by 4 (it doesn't work otherwise and freezes).
 #define MAX_DATA_PAYLOAD 1488
+// Size of the image part header (command, offset, size)
+#define IMAGE_PART_HEADER 9
+// The largest payload we ever try on links with jumbo frames (fits into 9000 MTU, divisible by 4)
+#define MAX_JUMBO_PAYLOAD 8988
 
 #endif
@@ -0,0 +1,148 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shm.h"
+#include "shm_layout.h"
+#include "status.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct shm_header *region;
+
+// Remove the half-made region and give up
+static void init_fail(char *tmp_path, const char *what, const char *path) {
+	int error = errno;
+	unlink(tmp_path);
+	die("Couldn't %s shared status region %s: %s\n", what, path, strerror(error));
+}
+
+void shm_init(const char *path) {
+	/*
+	 * Make the region in a new file and rename it over the path. Readers may
+	 * still map the file of a previous run, truncating it would take the
+	 * pages away from under them.
+	 */
+	char *tmp_path = malloc(strlen(path) + 8);
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	if (fd == -1)
+		die("Couldn't create shared status region %s: %s\n", path, strerror(errno));
+	// Anyone may read the status
+	if (fchmod(fd, 0644) == -1)
+		init_fail(tmp_path, "set permissions of", path);
+	if (ftruncate(fd, SHM_SIZE) == -1)
+		init_fail(tmp_path, "resize", path);
+	region = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region == MAP_FAILED)
+		init_fail(tmp_path, "map", path);
+	// The mapping stays valid without the descriptor
+	if (close(fd) == -1)
+		init_fail(tmp_path, "close", path);
+	region->version = SHM_VERSION;
+	region->record_size = sizeof(struct shm_record);
+	region->record_count = SHM_RECORDS;
+	// The magic goes last, readers check it before looking at the rest
+	__atomic_store_n(&region->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	if (rename(tmp_path, path) == -1)
+		init_fail(tmp_path, "rename", path);
+	free(tmp_path);
+}
+
+static struct shm_record *write_begin(int slot) {
+	if (slot == -1)
+		return NULL;
+	struct shm_record *record = &region->records[slot];
+	__atomic_store_n(&record->seq, record->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return record;
+}
+
+static void write_end(struct shm_record *record, uint64_t now) {
+	record->updated = now;
+	__atomic_store_n(&record->seq, record->seq + 1, __ATOMIC_RELEASE);
+}
+
+int shm_slot_alloc(const char *ifname) {
+	if (!region)
+		return -1;
+	for (int i = 0; i < SHM_RECORDS; i ++)
+		if (!region->records[i].used) {
+			struct shm_record *record = write_begin(i);
+			uint32_t seq = record->seq;
+			*record = (struct shm_record) {
+				.seq = seq,
+				.used = 1
+			};
+			strncpy(record->ifname, ifname, sizeof record->ifname - 1);
+			write_end(record, 0);
+			return i;
+		}
+	error_msg("No free record for interface %s in the shared status region\n", ifname);
+	return -1;
+}
+
+void shm_slot_free(int slot) {
+	struct shm_record *record = write_begin(slot);
+	if (record) {
+		record->used = 0;
+		write_end(record, 0);
+	}
+}
+
+void shm_state(int slot, unsigned autom_state, uint64_t now) {
+	struct shm_record *record = write_begin(slot);
+	if (record) {
+		record->autom_state = autom_state;
+		record->state_since = now;
+		write_end(record, now);
+	}
+}
+
+void shm_status(int slot, const char *status, uint64_t now) {
+	struct shm_record *record = write_begin(slot);
+	if (record) {
+		strncpy(record->status, status, sizeof record->status - 1);
+		record->status[sizeof record->status - 1] = '\0';
+		write_end(record, now);
+	}
+}
+
+void shm_report(int slot, const struct line_report *report, uint64_t now) {
+	struct shm_record *record = write_begin(slot);
+	if (record) {
+		record->line_state = report->state;
+		record->standard = report->standard;
+		record->annex = report->annex;
+		record->power = report->power;
+		record->dsmax = report->dsmax;
+		record->usmax = report->usmax;
+		record->dscur = report->dscur;
+		record->uscur = report->uscur;
+		record->dspower = report->dspower;
+		record->uspower = report->uspower;
+		record->report_time = now;
+		write_end(record, now);
+	}
+}
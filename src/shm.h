@@ -0,0 +1,38 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_SHM_H
+#define SMRT_SHM_H
+
+#include <stdint.h>
+
+struct line_report;
+
+// Create the shared memory status region in the given file (in /dev/shm, usually)
+void shm_init(const char *path);
+// Take a record for the interface. -1 is returned if there's no region or no free record.
+int shm_slot_alloc(const char *ifname);
+void shm_slot_free(int slot);
+// The automaton changed its state
+void shm_state(int slot, unsigned autom_state, uint64_t now);
+// Set the textual status
+void shm_status(int slot, const char *status, uint64_t now);
+// The modem reported the line status
+void shm_report(int slot, const struct line_report *report, uint64_t now);
+
+#endif
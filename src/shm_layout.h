@@ -0,0 +1,77 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_SHM_LAYOUT_H
+#define SMRT_SHM_LAYOUT_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the shared memory status region. It is shared between the
+ * daemon (the only writer) and any number of readers, so change the version
+ * whenever the layout changes.
+ *
+ * Each record is protected by a sequence lock. The writer makes the seq odd
+ * before changing the record and even again afterwards. A reader copies the
+ * record and uses the copy only if the seq was the same even number before
+ * and after the copy.
+ *
+ * The times are milliseconds of CLOCK_MONOTONIC.
+ */
+
+#define SHM_MAGIC 0x534d5254 // SMRT
+#define SHM_VERSION 1
+#define SHM_RECORDS 256
+
+struct shm_record {
+	uint32_t seq;
+	// Non-zero if the record describes an interface
+	uint32_t used;
+	char ifname[16];
+	// The same as the status field in the status file
+	char status[24];
+	// The automaton state (enum autom_state)
+	uint32_t autom_state;
+	// The last status reported by the modem (valid if report_time is non-zero)
+	uint8_t line_state;
+	uint8_t standard;
+	uint8_t annex;
+	uint8_t power;
+	uint32_t dsmax, usmax;
+	uint32_t dscur, uscur;
+	uint16_t dspower, uspower;
+	uint32_t reserved;
+	// When the automaton entered the current state
+	uint64_t state_since;
+	// When the modem reported the line status
+	uint64_t report_time;
+	// When the record changed last time
+	uint64_t updated;
+};
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t record_count;
+	struct shm_record records[];
+};
+
+#define SHM_SIZE (sizeof(struct shm_header) + SHM_RECORDS * sizeof(struct shm_record))
+
+#endif
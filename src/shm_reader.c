@@ -0,0 +1,96 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shm_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * How many times to try reading a record that is being written. The daemon
+ * holds it only for a moment, a record that stays busy was left half-written
+ * by a daemon that died.
+ */
+#define READ_TRIES 1000
+
+struct shm_reader {
+	const struct shm_header *header;
+	size_t size;
+};
+
+struct shm_reader *shm_reader_open(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = st.st_size;
+	const struct shm_header *header = NULL;
+	if (size >= sizeof *header)
+		header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED)
+		return NULL;
+	if (!header || __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || header->version != SHM_VERSION || header->record_size != sizeof(struct shm_record) || size < sizeof *header + header->record_count * sizeof(struct shm_record)) {
+		if (header)
+			munmap((void *)header, size);
+		errno = EPROTO;
+		return NULL;
+	}
+	struct shm_reader *reader = malloc(sizeof *reader);
+	*reader = (struct shm_reader) {
+		.header = header,
+		.size = size
+	};
+	return reader;
+}
+
+void shm_reader_close(struct shm_reader *reader) {
+	munmap((void *)reader->header, reader->size);
+	free(reader);
+}
+
+size_t shm_reader_count(const struct shm_reader *reader) {
+	return reader->header->record_count;
+}
+
+bool shm_reader_get(const struct shm_reader *reader, size_t index, struct shm_record *record) {
+	const struct shm_record *shared = &reader->header->records[index];
+	for (size_t i = 0; i < READ_TRIES; i ++) {
+		uint32_t before = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			// Being written right now, let the daemon finish
+			sched_yield();
+			continue;
+		}
+		memcpy(record, (const void *)shared, sizeof *record);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == before)
+			return record->used;
+	}
+	errno = EAGAIN;
+	return false;
+}
@@ -0,0 +1,44 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_SHM_READER_H
+#define SMRT_SHM_READER_H
+
+#include "shm_layout.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * Reader of the shared memory status region of smrtd. Once the region is
+ * mapped, reading the records needs no system calls and no locks.
+ */
+struct shm_reader;
+
+// Map the region. NULL is returned (and errno set) on error.
+struct shm_reader *shm_reader_open(const char *path);
+void shm_reader_close(struct shm_reader *reader);
+// Number of records in the region
+size_t shm_reader_count(const struct shm_reader *reader);
+/*
+ * Get a consistent copy of a record. Returns false if the record is not used
+ * or if it stays in the middle of a write (errno is EAGAIN then).
+ */
+bool shm_reader_get(const struct shm_reader *reader, size_t index, struct shm_record *record);
+
+#endif
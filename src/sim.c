@@ -0,0 +1,361 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Discrete-event simulation of the daemon talking to emulated modems. The
+ * interfaces and the automaton are the real ones, but they run on virtual
+ * interfaces and in virtual time, jumping from one event to the next. Hours
+ * of the protocol take a fraction of a second.
+ */
+
+#include "interface.h"
+#include "configuration.h"
+#include "metrics.h"
+#include "modem.h"
+#include "fault.h"
+#include "proto_const.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+
+static const uint8_t modem_mac[ETH_ALEN] = { 6, 5, 4, 3, 2, 1 };
+
+enum event_kind {
+	// The timeout of the interface
+	EK_TIMER,
+	// A frame for the modem
+	EK_TO_MODEM,
+	// A frame for the daemon
+	EK_TO_DAEMON
+};
+
+struct sim_modem {
+	char name[IFNAMSIZ];
+	uint8_t mac[ETH_ALEN];
+	struct interface_state *interface;
+	struct modem modem;
+	struct fault_rng rng;
+	// Only the timer event with this generation is valid, the older ones were replaced
+	uint64_t timer_gen;
+	// A frame in each direction waiting to be overtaken (reordered)
+	struct fault_hold held[2];
+};
+
+struct event {
+	uint64_t due;
+	// Order of scheduling, the events with the same time happen in this order
+	uint64_t seq;
+	enum event_kind kind;
+	struct sim_modem *modem;
+	// The timer generation
+	uint64_t gen;
+	// Replaced by a copy with another time
+	bool cancelled;
+	size_t size;
+	uint8_t data[];
+};
+
+static struct sim_modem *modems;
+static size_t modem_count;
+// The virtual time (ms)
+static uint64_t now;
+// Latency of the wire in each direction (ms)
+static unsigned latency = 1;
+
+// Binary min-heap of the events
+static struct event **heap;
+static size_t heap_size, heap_capacity;
+static uint64_t event_seq, events_handled;
+
+static bool event_before(const struct event *a, const struct event *b) {
+	return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void heap_push(struct event *event) {
+	if (heap_size == heap_capacity) {
+		heap_capacity = heap_capacity ? 2 * heap_capacity : 64;
+		heap = realloc(heap, heap_capacity * sizeof *heap);
+	}
+	event->seq = event_seq ++;
+	size_t pos = heap_size ++;
+	while (pos && event_before(event, heap[(pos - 1) / 2])) {
+		heap[pos] = heap[(pos - 1) / 2];
+		pos = (pos - 1) / 2;
+	}
+	heap[pos] = event;
+}
+
+static struct event *heap_pop(void) {
+	struct event *result = heap[0], *last = heap[-- heap_size];
+	size_t pos = 0;
+	for (;;) {
+		size_t child = 2 * pos + 1;
+		if (child >= heap_size)
+			break;
+		if (child + 1 < heap_size && event_before(heap[child + 1], heap[child]))
+			child ++;
+		if (!event_before(heap[child], last))
+			break;
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = last;
+	return result;
+}
+
+static struct event *event_alloc(enum event_kind kind, struct sim_modem *m, uint64_t due, const uint8_t *data, size_t size) {
+	struct event *event = malloc(sizeof *event + size);
+	*event = (struct event) {
+		.due = due,
+		.kind = kind,
+		.modem = m,
+		.size = size
+	};
+	if (size)
+		memcpy(event->data, data, size);
+	return event;
+}
+
+// Schedule the next timeout of the interface, replacing the previous one
+static void timer_arm(struct sim_modem *m) {
+	struct event *event = event_alloc(EK_TIMER, m, 0, NULL, 0);
+	event->gen = ++ m->timer_gen;
+	int timeout = interface_timeout(m->interface, now);
+	if (timeout == -1) {
+		free(event);
+		return;
+	}
+	event->due = now + timeout;
+	heap_push(event);
+}
+
+// Put a frame on the wire, through the faults
+static void transmit(struct sim_modem *m, enum event_kind kind, const uint8_t *data, size_t size) {
+	struct fault_hold *hold = &m->held[kind == EK_TO_DAEMON];
+	struct fault_plan plan = fault_plan(&m->rng, hold, now + latency, data[0]);
+	for (unsigned copy = 0; copy < plan.copies; copy ++) {
+		struct event *event = event_alloc(kind, m, plan.due[copy], data, size);
+		heap_push(event);
+		if ((int)copy == plan.hold)
+			hold->frame = event;
+		if ((int)copy == plan.overtaken_by) {
+			// The held frame follows right after this one (the heap can't move it, so it is replaced by a copy)
+			struct event *overtaken = plan.overtaken;
+			overtaken->cancelled = true;
+			heap_push(event_alloc(kind, m, plan.overtaken_due, overtaken->data, overtaken->size));
+		}
+	}
+}
+
+// The daemon's line got woken up by another one
+static void daemon_wake(void *data) {
+	timer_arm(data);
+}
+
+// The daemon sends a frame
+static void daemon_send(void *data, const void *frame, size_t size) {
+	if (size <= sizeof(struct ethhdr))
+		return;
+	transmit(data, EK_TO_MODEM, (const uint8_t *)frame + sizeof(struct ethhdr), size - sizeof(struct ethhdr));
+}
+
+static void event_handle(struct event *event) {
+	struct sim_modem *m = event->modem;
+	switch (event->kind) {
+		case EK_TIMER:
+			if (event->gen != m->timer_gen)
+				return; // Replaced by a newer one
+			if (interface_due(m->interface, now))
+				interface_tick(m->interface, now);
+			break;
+		case EK_TO_MODEM: {
+			uint8_t answer[MODEM_ANSWER_MAX];
+			size_t answer_size = modem_input(&m->modem, now, event->data, event->size, answer);
+			if (answer_size)
+				transmit(m, EK_TO_DAEMON, answer, answer_size);
+			return;
+		}
+		case EK_TO_DAEMON: {
+			uint8_t frame[sizeof(struct ethhdr) + MODEM_ANSWER_MAX];
+			struct ethhdr *hdr = (struct ethhdr *)frame;
+			memcpy(hdr->h_dest, m->mac, ETH_ALEN);
+			memcpy(hdr->h_source, modem_mac, ETH_ALEN);
+			hdr->h_proto = htons(CONTROL_PROTOCOL);
+			memcpy(frame + sizeof *hdr, event->data, event->size);
+			interface_input(m->interface, now, frame, sizeof *hdr + event->size);
+			break;
+		}
+	}
+	// The interface might have changed its timeout
+	timer_arm(m);
+}
+
+static void run(uint64_t end) {
+	while (heap_size && heap[0]->due <= end) {
+		struct event *event = heap_pop();
+		now = event->due;
+		if (event->kind != EK_TIMER && event->modem->held[event->kind == EK_TO_DAEMON].frame == event)
+			event->modem->held[event->kind == EK_TO_DAEMON].frame = NULL;
+		if (!event->cancelled) {
+			event_handle(event);
+			events_handled ++;
+		}
+		free(event);
+	}
+	now = end;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n modems] [-d seconds] [-L latency_ms] [-S image_size] " MODEM_USAGE " [-c] [-- daemon options]\n", name);
+	exit(1);
+}
+
+static uint64_t wall_ms(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		die("Couldn't get time: %s\n", strerror(errno));
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Write an image of the given size full of pseudo-random bytes
+static void image_create(const char *path, size_t size) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		die("Couldn't create %s: %s\n", path, strerror(errno));
+	uint8_t buffer[4096];
+	while (size) {
+		size_t chunk = size < sizeof buffer ? size : sizeof buffer;
+		for (size_t i = 0; i < chunk; i ++)
+			buffer[i] = random();
+		if (write(fd, buffer, chunk) != (ssize_t)chunk)
+			die("Couldn't write %s: %s\n", path, strerror(errno));
+		size -= chunk;
+	}
+	if (close(fd) == -1)
+		die("Couldn't close %s: %s\n", path, strerror(errno));
+}
+
+int main(int argc, char *argv[]) {
+	struct modem_config config = modem_config_default;
+	size_t count = 10, image_size = 1024 * 1024;
+	uint64_t seed = 1, duration = 3600;
+	bool check = false;
+	int option;
+	// The + stops at the first non-option, the daemon options follow the --
+	while ((option = getopt(argc, argv, "+n:d:L:S:c" MODEM_OPTIONS)) != -1) {
+		switch (option) {
+			case 'n':
+				count = modem_option_number(optarg);
+				break;
+			case 'd':
+				duration = modem_option_number(optarg);
+				break;
+			case 'L':
+				latency = modem_option_number(optarg);
+				break;
+			case 'S':
+				image_size = modem_option_number(optarg);
+				break;
+			case 'c':
+				check = true;
+				break;
+			default:
+				if (!modem_option(option, optarg, &config, &seed))
+					usage(argv[0]);
+		}
+	}
+	if (!count || count > 0xffff) // The index goes into the MAC address
+		usage(argv[0]);
+	// A scratch directory for the status files and the image
+	char dir[] = "/tmp/smrt-sim.XXXXXX";
+	if (!mkdtemp(dir))
+		die("Couldn't create a temporary directory: %s\n", strerror(errno));
+	char image[sizeof dir + 16];
+	snprintf(image, sizeof image, "%s/image", dir);
+	// The jitter of the timeouts is random too, make it all repeatable
+	srandom(seed);
+	image_create(image, image_size);
+	/*
+	 * Configure the daemon like from its command line. The defaults come
+	 * first, so the daemon options given after -- override them.
+	 */
+	modems = calloc(count, sizeof *modems);
+	modem_count = count;
+	size_t daemon_argc = 9 + (argc - optind) + 2 * count;
+	char **daemon_argv = calloc(daemon_argc + 1, sizeof *daemon_argv);
+	size_t pos = 0;
+	daemon_argv[pos ++] = argv[0];
+	daemon_argv[pos ++] = "-f";
+	daemon_argv[pos ++] = image;
+	daemon_argv[pos ++] = "-v";
+	daemon_argv[pos ++] = "simulated";
+	daemon_argv[pos ++] = "-s";
+	daemon_argv[pos ++] = dir;
+	daemon_argv[pos ++] = "-l";
+	daemon_argv[pos ++] = "error";
+	for (int i = optind; i < argc; i ++)
+		daemon_argv[pos ++] = argv[i];
+	for (size_t i = 0; i < count; i ++) {
+		snprintf(modems[i].name, sizeof modems[i].name, "sim%u", (unsigned)i);
+		daemon_argv[pos ++] = "-i";
+		daemon_argv[pos ++] = modems[i].name;
+	}
+	optind = 0; // Start parsing again from the beginning
+	configure(daemon_argc, daemon_argv);
+	config.version = fw_version;
+	now = 1000;
+	for (size_t i = 0; i < count; i ++) {
+		struct sim_modem *m = &modems[i];
+		const uint8_t mac[ETH_ALEN] = { 2, 0, 0, 0, (i + 1) >> 8, i + 1 };
+		memcpy(m->mac, mac, ETH_ALEN);
+		modem_init(&m->modem, &config, now);
+		fault_rng_init(&m->rng, seed, i);
+		m->interface = interface_alloc_virtual(m->name, now, i + 1, m->mac, 1500, daemon_send, daemon_wake, m);
+		timer_arm(m);
+	}
+	uint64_t start = wall_ms();
+	run(now + duration * 1000);
+	uint64_t wall = wall_ms() - start;
+	// Same form as the emulator, so the same scripts can pick it up
+	uint64_t *times = malloc(count * sizeof *times);
+	size_t online = 0;
+	for (size_t i = 0; i < count; i ++)
+		if (modems[i].modem.online_at)
+			times[online ++] = modems[i].modem.online_at - modems[i].modem.first_seen;
+	modem_result(count, times, online);
+	uint64_t transitions = metric_totals[MC_TRANSITIONS];
+	printf("speed virtual_ms=%llu wall_ms=%llu events=%llu transitions=%llu frames=%llu transitions_per_second=%.0f\n", (unsigned long long)duration * 1000, (unsigned long long)wall, (unsigned long long)events_handled, (unsigned long long)transitions, (unsigned long long)(metric_totals[MC_FRAMES_SENT] + metric_totals[MC_FRAMES_RECEIVED]), transitions * 1000.0 / (wall ? wall : 1));
+	free(times);
+	for (size_t i = 0; i < count; i ++)
+		interface_release(modems[i].interface);
+	while (heap_size)
+		free(heap_pop());
+	if (unlink(image) == -1)
+		die("Couldn't remove %s: %s\n", image, strerror(errno));
+	if (rmdir(dir) == -1)
+		error_msg("Couldn't remove %s: %s\n", dir, strerror(errno));
+	return check && online != count ? 2 : 0;
+}
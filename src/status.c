@@ -0,0 +1,86 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "status.h"
+#include "configuration.h"
+#include "util.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void status_init(struct status *status, const char *ifname) {
+	*status = (struct status) {
+		.path = strdup(interface_status_path(ifname))
+	};
+	status->tmp_path = malloc(strlen(status->path) + 5);
+	sprintf(status->tmp_path, "%s.tmp", status->path);
+}
+
+void status_destroy(struct status *status) {
+	if (unlink(status->path) == -1) {
+		if (errno == ENOENT)
+			msg("File %s not removed as it doesn't exist\n", status->path);
+		else
+			die("Couldn't remove interface status file %s: %s\n", status->path, strerror(errno));
+	}
+	free(status->path);
+	free(status->tmp_path);
+}
+
+void status_begin(struct status *status) {
+	status->len = 0;
+}
+
+void status_printf(struct status *status, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int result = vsnprintf(status->buffer + status->len, STATUS_MAX - status->len, format, args);
+	va_end(args);
+	if (result < 0 || (size_t)result >= STATUS_MAX - status->len)
+		die("Status of %s doesn't fit into the buffer\n", status->path);
+	status->len += result;
+}
+
+void status_commit(struct status *status) {
+	if (status->exists && status->len == status->written_len && memcmp(status->buffer, status->written, status->len) == 0)
+		return; // Nothing changed, don't touch the file
+	uint64_t start = metric_clock();
+	int fd = open(status->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		die("Failed to write status to file %s: %s\n", status->tmp_path, strerror(errno));
+	ssize_t written;
+	while ((written = write(fd, status->buffer, status->len)) == -1 && errno == EINTR)
+		;
+	if (written == -1)
+		die("Failed to write status to file %s: %s\n", status->tmp_path, strerror(errno));
+	if ((size_t)written != status->len)
+		die("Written only %zd bytes out of %zu to status file %s\n", written, status->len, status->tmp_path);
+	if (close(fd) == -1)
+		die("Failed to close status file %s: %s\n", status->tmp_path, strerror(errno));
+	if (rename(status->tmp_path, status->path) == -1)
+		die("Failed to move status file %s to %s: %s\n", status->tmp_path, status->path, strerror(errno));
+	memcpy(status->written, status->buffer, status->len);
+	status->written_len = status->len;
+	status->exists = true;
+	metric_observe(MH_STATUS_WRITE, metric_clock() - start);
+}
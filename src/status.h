@@ -0,0 +1,65 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_STATUS_H
+#define SMRT_STATUS_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Status of the DSL line as reported by the modem (in host byte order)
+struct line_report {
+	uint8_t state;
+	uint8_t standard;
+	uint8_t annex;
+	uint8_t power;
+	uint32_t dsmax, usmax;
+	uint32_t dscur, uscur;
+	uint16_t dspower, uspower;
+};
+
+// The status files are small, this is more than enough
+#define STATUS_MAX 1024
+
+/*
+ * The status file of one interface. The content is first rendered into a
+ * buffer. It is written only if it differs from what is in the file already
+ * and it is written into a temporary file which is then renamed over the
+ * real one, so readers never see a partial file.
+ */
+struct status {
+	char *path;
+	char *tmp_path;
+	char buffer[STATUS_MAX];
+	size_t len;
+	char written[STATUS_MAX];
+	size_t written_len;
+	bool exists;
+};
+
+void status_init(struct status *status, const char *ifname);
+// Remove the file and free the resources
+void status_destroy(struct status *status);
+// Start rendering new content
+void status_begin(struct status *status);
+void status_printf(struct status *status, const char *format, ...) __attribute__((format(printf, 2, 3)));
+// Publish the rendered content (if it changed)
+void status_commit(struct status *status);
+
+#endif
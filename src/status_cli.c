@@ -0,0 +1,62 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Print the content of the shared memory status region of smrtd.
+
+#include "shm_reader.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <shared_status_path>\n", argv[0]);
+		return 1;
+	}
+	struct shm_reader *reader = shm_reader_open(argv[1]);
+	if (!reader) {
+		fprintf(stderr, "Couldn't open %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	uint64_t now = now_ms();
+	for (size_t i = 0; i < shm_reader_count(reader); i ++) {
+		struct shm_record r;
+		errno = 0;
+		if (!shm_reader_get(reader, i, &r)) {
+			if (errno == EAGAIN)
+				fprintf(stderr, "Record %zu is stuck in the middle of a write\n", i);
+			continue;
+		}
+		r.ifname[sizeof r.ifname - 1] = '\0';
+		r.status[sizeof r.status - 1] = '\0';
+		printf("%s: %s (automaton state %u for %llu s)", r.ifname, r.status, (unsigned)r.autom_state, r.state_since ? (unsigned long long)(now - r.state_since) / 1000 : 0ULL);
+		if (r.report_time)
+			printf(", speed %u/%u (max %u/%u), power %u/%u, power state %u, reported %llu s ago", (unsigned)r.dscur, (unsigned)r.uscur, (unsigned)r.dsmax, (unsigned)r.usmax, (unsigned)r.dspower, (unsigned)r.uspower, (unsigned)r.power, (unsigned long long)(now - r.report_time) / 1000);
+		putchar('\n');
+	}
+	shm_reader_close(reader);
+	return 0;
+}
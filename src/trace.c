@@ -0,0 +1,99 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct trace_record trace_ring[TRACE_RECORDS];
+size_t trace_pos;
+
+static struct trace_name names[TRACE_NAMES];
+static size_t name_count, name_next;
+
+void trace_name(int iface, const char *name) {
+	size_t idx;
+	for (idx = 0; idx < name_count; idx ++)
+		if (names[idx].iface == iface)
+			break;
+	if (idx == name_count) {
+		// A new one. If the table is full, forget the oldest.
+		idx = name_next;
+		name_next = (name_next + 1) % TRACE_NAMES;
+		if (name_count < TRACE_NAMES)
+			name_count ++;
+	}
+	names[idx] = (struct trace_name) {
+		.iface = iface
+	};
+	strncpy(names[idx].name, name, sizeof names[idx].name - 1);
+}
+
+const char *trace_dump(const char *path) {
+	size_t count = trace_pos < TRACE_RECORDS ? trace_pos : TRACE_RECORDS;
+	/*
+	 * Write into a new temporary file (created exclusively, so nobody can slip
+	 * a symlink in its place) and rename it over the path when complete.
+	 */
+	char *tmp_path = malloc(strlen(path) + 8);
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		free(tmp_path);
+		return strerror(errno);
+	}
+	FILE *f = fdopen(fd, "wb");
+	if (!f) {
+		const char *error = strerror(errno);
+		close(fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		return error;
+	}
+	struct trace_file_header header = {
+		.magic = TRACE_MAGIC,
+		.name_count = name_count,
+		.record_count = count
+	};
+	bool ok = fwrite(&header, sizeof header, 1, f) == 1;
+	if (name_count)
+		ok = ok && fwrite(names, sizeof *names, name_count, f) == name_count;
+	// The oldest record is right after the newest one, if the ring wrapped around
+	size_t start = (trace_pos - count) & (TRACE_RECORDS - 1);
+	size_t first = count < TRACE_RECORDS - start ? count : TRACE_RECORDS - start;
+	ok = ok && fwrite(trace_ring + start, sizeof *trace_ring, first, f) == first;
+	if (count > first)
+		ok = ok && fwrite(trace_ring, sizeof *trace_ring, count - first, f) == count - first;
+	const char *error = ok ? NULL : strerror(errno);
+	if (fclose(f) == EOF && !error)
+		error = strerror(errno);
+	if (!error && rename(tmp_path, path) == -1)
+		error = strerror(errno);
+	if (error)
+		unlink(tmp_path);
+	else
+		msg("Dumped %zu trace records to %s\n", count, path);
+	free(tmp_path);
+	return error;
+}
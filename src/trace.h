@@ -0,0 +1,103 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_TRACE_H
+#define SMRT_TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * A ring of the last few thousand events, in compact binary form. Recording
+ * an event is just few stores, so it is always on. It can be dumped into a
+ * file and decoded by smrt-trace.
+ *
+ * The dump file starts with a struct trace_file_header, followed by the name
+ * table (struct trace_name) and the records, oldest first. Everything is in
+ * the host byte order.
+ */
+
+#define TRACE_RECORDS 4096 // Must be a power of 2
+#define TRACE_NAMES 64
+#define TRACE_MAGIC "SMRTTRC1"
+
+enum trace_event {
+	// The automaton entered a state (arg is the previous one)
+	TE_ENTER,
+	// Timeout after all the retries
+	TE_TIMEOUT,
+	// A request was sent again
+	TE_RETRANSMIT,
+	// A frame was sent (arg is the command)
+	TE_TX,
+	// A frame was received (arg is the command)
+	TE_RX,
+	// A frame not from the modem was received and ignored
+	TE_FOREIGN,
+	TE_LINK_UP,
+	TE_LINK_DOWN
+};
+
+struct trace_record {
+	// Milliseconds (lower bits of the monotonic time)
+	uint32_t time;
+	// The interface index
+	uint16_t iface;
+	uint8_t event;
+	// The automaton state
+	uint8_t state;
+	// The sequence number of a request or answer
+	uint16_t seq;
+	// Size of the frame
+	uint16_t size;
+	// Event specific
+	uint32_t arg;
+};
+
+struct trace_name {
+	uint16_t iface;
+	char name[16];
+};
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t name_count;
+	uint32_t record_count;
+};
+
+extern struct trace_record trace_ring[TRACE_RECORDS];
+extern size_t trace_pos;
+
+static inline void trace(uint64_t now, int iface, enum trace_event event, unsigned state, unsigned seq, unsigned size, uint32_t arg) {
+	trace_ring[trace_pos ++ & (TRACE_RECORDS - 1)] = (struct trace_record) {
+		.time = now,
+		.iface = iface,
+		.event = event,
+		.state = state,
+		.seq = seq,
+		.size = size,
+		.arg = arg
+	};
+}
+
+// Remember the name of an interface, so the dump can be decoded
+void trace_name(int iface, const char *name);
+// Write the ring into a file. Returns NULL on success, error description otherwise.
+const char *trace_dump(const char *path);
+
+#endif
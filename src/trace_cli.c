@@ -0,0 +1,115 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decode the event trace dumped by smrtd.
+
+#include "trace.h"
+#include "automaton.h"
+#include "proto_const.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *const event_names[] = {
+	[TE_ENTER] = "enter",
+	[TE_TIMEOUT] = "timeout",
+	[TE_RETRANSMIT] = "retransmit",
+	[TE_TX] = "tx",
+	[TE_RX] = "rx",
+	[TE_FOREIGN] = "foreign",
+	[TE_LINK_UP] = "link-up",
+	[TE_LINK_DOWN] = "link-down"
+};
+
+static const char *const cmd_names[] = {
+	[CMD_OFFER_IMAGE] = "offer_image",
+	[CMD_IMG_DATA] = "img_data",
+	[CMD_IMG_ACK] = "img_ack",
+	[CMD_GET_PARAM] = "get_param",
+	[CMD_ANSWER_PARAM] = "answer_param",
+	[CMD_SET_PARAM] = "set_param",
+	[CMD_PARAM_ACK] = "param_ack"
+};
+
+static const char *lookup(const char *const *names, size_t count, unsigned idx) {
+	if (idx < count && names[idx])
+		return names[idx];
+	return "unknown";
+}
+
+static const char *iface_name(const struct trace_name *names, size_t count, unsigned iface) {
+	for (size_t i = 0; i < count; i ++)
+		if (names[i].iface == iface)
+			return names[i].name;
+	return "?";
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace_dump>\n", argv[0]);
+		return 1;
+	}
+	FILE *f = fopen(argv[1], "rb");
+	if (!f) {
+		fprintf(stderr, "Couldn't open %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	struct trace_file_header header;
+	if (fread(&header, sizeof header, 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0 || header.name_count > TRACE_NAMES) {
+		fprintf(stderr, "%s is not a smrtd trace\n", argv[1]);
+		return 1;
+	}
+	struct trace_name names[TRACE_NAMES];
+	if (fread(names, sizeof *names, header.name_count, f) != header.name_count) {
+		fprintf(stderr, "%s is truncated\n", argv[1]);
+		return 1;
+	}
+	for (size_t i = 0; i < header.name_count; i ++)
+		names[i].name[sizeof names[i].name - 1] = '\0';
+	struct trace_record r;
+	uint32_t first = 0;
+	for (uint32_t i = 0; i < header.record_count; i ++) {
+		if (fread(&r, sizeof r, 1, f) != 1) {
+			fprintf(stderr, "%s is truncated\n", argv[1]);
+			return 1;
+		}
+		if (!i)
+			first = r.time;
+		// Relative to the first record, the absolute value has no meaning
+		printf("%10.3f %-8s %-10s %-18s", (uint32_t)(r.time - first) / 1000.0, iface_name(names, header.name_count, r.iface), lookup(event_names, sizeof event_names / sizeof *event_names, r.event), autom_state_name(r.state));
+		switch (r.event) {
+			case TE_ENTER:
+				printf(" from %s", autom_state_name(r.arg));
+				break;
+			case TE_TX:
+			case TE_RX:
+			case TE_RETRANSMIT:
+				printf(" %s seq %u size %u", lookup(cmd_names, sizeof cmd_names / sizeof *cmd_names, r.arg), (unsigned)r.seq, (unsigned)r.size);
+				break;
+			case TE_FOREIGN:
+				printf(" size %u", (unsigned)r.size);
+				break;
+			default:
+				break;
+		}
+		putchar('\n');
+	}
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "upload.h"
+#include "configuration.h"
+#include "util.h"
+
+#include <assert.h>
+
+/*
+ * The image parts time out after 50ms. If the acks take more than this on
+ * average (ms), we're overloading ourselves or the modems and should slow
+ * down. If they are faster than the other one, there's room for more.
+ */
+#define RTT_HIGH 20
+#define RTT_LOW 5
+// Number of acks to wait after changing the limit before changing it again
+#define HOLD_ACKS 32
+// Fixed point of the average round trip time (it's kept in 1/8 ms)
+#define RTT_SHIFT 3
+
+// The waiting uploads, the next one to go first
+static struct upload *queue;
+static unsigned active_count;
+static unsigned limit;
+static unsigned rtt_avg;
+static unsigned hold;
+
+static unsigned current_limit(void) {
+	if (!limit)
+		limit = upload_max;
+	return limit;
+}
+
+// Put it at the end of the queue, but before the lines with more failed uploads (they go last)
+static void enqueue(struct upload *upload) {
+	struct upload **u = &queue;
+	while (*u && (*u)->failures <= upload->failures)
+		u = &(*u)->next;
+	upload->next = *u;
+	*u = upload;
+	upload->queued = true;
+}
+
+static void dequeue(struct upload *upload) {
+	for (struct upload **u = &queue; *u; u = &(*u)->next)
+		if (*u == upload) {
+			*u = upload->next;
+			break;
+		}
+	upload->next = NULL;
+	upload->queued = false;
+}
+
+static void activate(struct upload *upload) {
+	dequeue(upload);
+	upload->active = true;
+	upload->started = false;
+	upload->completed = false;
+	active_count ++;
+	dbg("Upload slot taken, %u of %u in use\n", active_count, limit);
+}
+
+// Hand the free slots to the first ones in the queue
+static void admit_waiting(void) {
+	while (queue && active_count < current_limit()) {
+		struct upload *upload = queue;
+		activate(upload);
+		if (upload->wake)
+			upload->wake(upload->wake_data);
+	}
+}
+
+bool upload_admit(struct upload *upload) {
+	if (upload->active)
+		return true;
+	if (!upload->queued)
+		enqueue(upload);
+	// Only the first one in the queue may go
+	if (queue != upload || active_count >= current_limit())
+		return false;
+	activate(upload);
+	return true;
+}
+
+void upload_start(struct upload *upload, uint64_t now) {
+	assert(upload->active);
+	upload->started = true;
+	upload->started_at = upload->part_sent = now;
+}
+
+void upload_part_sent(struct upload *upload, uint64_t now) {
+	upload->part_sent = now;
+}
+
+void upload_part_acked(struct upload *upload, uint64_t now) {
+	unsigned rtt = now - upload->part_sent;
+	// Exponentially weighted average, the new sample has weight 1/8
+	rtt_avg = rtt_avg - (rtt_avg >> 3) + (rtt << RTT_SHIFT >> 3);
+	if (hold) {
+		hold --;
+		return;
+	}
+	if (rtt_avg > (RTT_HIGH << RTT_SHIFT) && limit > 1) {
+		limit /= 2;
+		hold = HOLD_ACKS;
+		msg("Firmware uploads are slow (%u ms per part), lowering the limit to %u\n", rtt_avg >> RTT_SHIFT, limit);
+	} else if (rtt_avg < (RTT_LOW << RTT_SHIFT) && queue && active_count >= limit && limit < (unsigned)upload_max) {
+		limit ++;
+		hold = HOLD_ACKS;
+		dbg("Firmware uploads are fast, raising the limit to %u\n", limit);
+		admit_waiting();
+	}
+}
+
+void upload_complete(struct upload *upload) {
+	upload->completed = true;
+}
+
+void upload_release(struct upload *upload) {
+	if (upload->queued)
+		dequeue(upload);
+	if (upload->active) {
+		upload->active = false;
+		assert(active_count);
+		active_count --;
+		if (upload->completed)
+			upload->failures = 0;
+		else if (upload->started)
+			upload->failures ++;
+		dbg("Upload slot released, %u of %u in use\n", active_count, limit);
+		admit_waiting();
+	}
+}
+
+unsigned upload_active_count(void) {
+	return active_count;
+}
+
+unsigned upload_limit(void) {
+	return current_limit();
+}
@@ -0,0 +1,71 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_UPLOAD_H
+#define SMRT_UPLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Admission control of firmware uploads. Only a limited number of modems
+ * is fed with firmware at once, the rest waits in a queue. The limit adapts
+ * to how fast the modems acknowledge the image parts.
+ */
+// Called when a queued upload got its slot, the line should go on.
+typedef void (*upload_wake_hook)(void *data);
+
+struct upload {
+	// Who to tell when the slot is granted (set by the owner of the line)
+	upload_wake_hook wake;
+	void *wake_data;
+	// Waiting in the queue
+	bool queued;
+	// Holding one of the upload slots
+	bool active;
+	// The image is being sent (not only offered)
+	bool started;
+	// The modem confirmed the whole image
+	bool completed;
+	// Number of uploads that didn't complete in a row. Such lines wait behind the others.
+	unsigned failures;
+	// When the image started to be sent
+	uint64_t started_at;
+	// When the last image part was sent
+	uint64_t part_sent;
+	struct upload *next;
+};
+
+// Ask for an upload slot. If none is available now, the upload is queued (if it is not already) and false is returned. The wake hook is called once the slot is granted.
+bool upload_admit(struct upload *upload);
+// The image is being sent now.
+void upload_start(struct upload *upload, uint64_t now);
+// An image part was sent.
+void upload_part_sent(struct upload *upload, uint64_t now);
+// An image part got acknowledged. Used to adapt the number of concurrent uploads.
+void upload_part_acked(struct upload *upload, uint64_t now);
+// The modem accepted the whole image.
+void upload_complete(struct upload *upload);
+// Number of uploads running now
+unsigned upload_active_count(void);
+// The current limit of concurrent uploads
+unsigned upload_limit(void);
+// The line doesn't upload (or wait for upload) any more. Free the slot or leave the queue, waking the next in the queue. It's OK to call it on a line that holds neither.
+void upload_release(struct upload *upload);
+
+#endif
@@ -18,35 +18,204 @@
 
 #include "util.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-void die(const char *message, ...) {
-	va_list args, copy;
-	va_start(args, message);
-	va_copy(copy, args);
-	vsyslog(LOG_MAKEPRI(LOG_DAEMON, LOG_CRIT), message, copy);
-	va_end(copy);
+enum log_level log_level = LL_INFO;
+
+// At most LIMIT_BURST of each message per interface in LIMIT_WINDOW ms
+#define LIMIT_WINDOW (60 * 1000)
+#define LIMIT_BURST 10
+
+static void limit_report(struct log_limit_kind *kind, const char *ifname) {
+	if (kind->suppressed)
+		log_write(LL_INFO, "%s: %u similar messages suppressed\n", ifname, kind->suppressed);
+	kind->suppressed = 0;
+}
+
+// May the message be logged now? Reports the suppressed ones when a new window starts.
+static bool limit_pass(struct log_limit *limit, uint64_t now, const char *ifname, const char *message) {
+	// Find the message, or take over the one not seen for the longest time
+	struct log_limit_kind *kind = &limit->kinds[0];
+	for (size_t i = 0; i < LOG_LIMIT_KINDS; i ++) {
+		if (limit->kinds[i].message == message) {
+			kind = &limit->kinds[i];
+			break;
+		}
+		if (limit->kinds[i].window_start < kind->window_start)
+			kind = &limit->kinds[i];
+	}
+	if (kind->message != message) {
+		limit_report(kind, ifname);
+		*kind = (struct log_limit_kind) {
+			.message = message,
+			.window_start = now
+		};
+	}
+	if (now - kind->window_start >= LIMIT_WINDOW) {
+		limit_report(kind, ifname);
+		kind->window_start = now;
+		kind->count = 0;
+	}
+	if (kind->count < LIMIT_BURST) {
+		kind->count ++;
+		return true;
+	}
+	kind->suppressed ++;
+	return false;
+}
+
+#define QUEUE_SIZE 64
+#define QUEUE_LINE 512
+
+static struct {
+	size_t len;
+	char data[QUEUE_LINE];
+} queue[QUEUE_SIZE];
+static size_t queue_head, queue_count, queue_dropped;
+static int log_sock = -1;
+// NULL until log_init, the programs that don't call it log to stderr only
+static const char *log_ident;
+// Don't try to connect to the syslog before this time
+static uint64_t connect_next;
+
+static void log_connect(void) {
+	int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return;
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+		.sun_path = "/dev/log"
+	};
+	if (connect(sock, (struct sockaddr *)&addr, sizeof addr) == -1) {
+		close(sock);
+		return;
+	}
+	log_sock = sock;
+}
+
+void log_init(const char *ident) {
+	log_ident = ident;
+	log_connect();
+}
+
+static void enqueue(int priority, const char *message, va_list args) {
+	if (queue_count == QUEUE_SIZE) {
+		queue_dropped ++;
+		return;
+	}
+	size_t idx = (queue_head + queue_count ++) % QUEUE_SIZE;
+	char *data = queue[idx].data;
+	time_t t = time(NULL);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	int len = snprintf(data, QUEUE_LINE, "<%d>", LOG_MAKEPRI(LOG_DAEMON, priority));
+	len += strftime(data + len, QUEUE_LINE - len, "%b %e %T ", &tm);
+	len += snprintf(data + len, QUEUE_LINE - len, "%s[%d]: ", log_ident, (int)getpid());
+	len += vsnprintf(data + len, QUEUE_LINE - len, message, args);
+	if (len >= QUEUE_LINE)
+		len = QUEUE_LINE - 1; // Truncated
+	// The syslog doesn't want the newline
+	if (len && data[len - 1] == '\n')
+		len --;
+	queue[idx].len = len;
+}
+
+// Hand the queued messages to the connected syslog
+static void queue_send(void) {
+	while (queue_count) {
+		if (send(log_sock, queue[queue_head].data, queue[queue_head].len, MSG_NOSIGNAL) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return; // Try again later
+			if (errno == ECONNREFUSED || errno == ENOTCONN) {
+				// The syslog daemon restarted, connect again next time
+				close(log_sock);
+				log_sock = -1;
+				return;
+			}
+			// Otherwise drop the message, it would fail again
+		}
+		queue_head = (queue_head + 1) % QUEUE_SIZE;
+		queue_count --;
+		if (!queue_count && queue_dropped) {
+			size_t dropped = queue_dropped;
+			queue_dropped = 0;
+			log_write(LL_INFO, "%zu messages dropped, the syslog is too slow\n", dropped);
+		}
+	}
+}
+
+void log_flush(uint64_t now) {
+	if (!queue_count)
+		return;
+	if (log_sock == -1) {
+		// The loop comes back for the pending messages, don't try to connect on each wakeup
+		if (now < connect_next)
+			return;
+		connect_next = now + LOG_RETRY;
+		log_connect();
+		if (log_sock == -1) {
+			// No syslog to talk to. The messages went to stderr at least.
+			queue_count = 0;
+			return;
+		}
+	}
+	queue_send();
+}
+
+bool log_pending(void) {
+	return queue_count;
+}
+
+// The syslog priority is for the messages of LL_ERROR and LL_INFO, the debug ones go to stderr only
+static void log_vwrite(enum log_level level, int priority, const char *message, va_list args) {
+	if (level != LL_DEBUG && log_ident) {
+		va_list copy;
+		va_copy(copy, args);
+		enqueue(priority, message, copy);
+		va_end(copy);
+	}
 	vfprintf(stderr, message, args);
+}
+
+void log_write(enum log_level level, const char *message, ...) {
+	va_list args;
+	va_start(args, message);
+	log_vwrite(level, level == LL_ERROR ? LOG_ERR : LOG_INFO, message, args);
 	va_end(args);
-	exit(1);
 }
 
-void msg(const char *message, ...) {
-	va_list args, copy;
+void log_line(struct log_limit *limit, uint64_t now, const char *ifname, enum log_level level, const char *message, ...) {
+	if (!limit_pass(limit, now, ifname, message))
+		return;
+	char text[QUEUE_LINE];
+	va_list args;
 	va_start(args, message);
-	va_copy(copy, args);
-	vsyslog(LOG_MAKEPRI(LOG_DAEMON, LOG_INFO), message, copy);
-	va_end(copy);
-	vfprintf(stderr, message, args);
+	vsnprintf(text, sizeof text, message, args);
 	va_end(args);
+	log_write(level, "%s: %s", ifname, text);
 }
 
-void dbg(const char *message, ...) {
+void die(const char *message, ...) {
 	va_list args;
 	va_start(args, message);
-	vfprintf(stderr, message, args);
+	log_vwrite(LL_ERROR, LOG_CRIT, message, args);
 	va_end(args);
+	// We are exiting, so it's fine to wait for the syslog now
+	if (log_sock == -1 && queue_count)
+		log_connect();
+	if (log_sock != -1) {
+		fcntl(log_sock, F_SETFL, fcntl(log_sock, F_GETFL) & ~O_NONBLOCK);
+		queue_send();
+	}
+	exit(1);
 }
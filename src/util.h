@@ -19,8 +19,76 @@
 #ifndef SMRT_UTIL_H
 #define SMRT_UTIL_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+enum log_level {
+	LL_ERROR,
+	LL_INFO,
+	LL_DEBUG
+};
+
+/*
+ * The most verbose level compiled in. Messages above it are removed by the
+ * compiler, including evaluation of their arguments (build with
+ * -DLOG_COMPILED=LL_INFO to get rid of the debug messages).
+ */
+#ifndef LOG_COMPILED
+#define LOG_COMPILED LL_DEBUG
+#endif
+
+// The most verbose level logged, set at runtime
+extern enum log_level log_level;
+
+#define log_enabled(level) ((level) <= LOG_COMPILED && (level) <= log_level)
+
 void die(const char *message, ...) __attribute__((noreturn)) __attribute__((format(printf, 1, 2)));
-void dbg(const char *message, ...) __attribute__((format(printf, 1, 2)));
-void msg(const char *message, ...) __attribute__((format(printf, 1, 2)));
+void log_write(enum log_level level, const char *message, ...) __attribute__((format(printf, 2, 3)));
+
+// The arguments are not evaluated if the level is disabled. Errors that are not fatal go through error_msg.
+#define error_msg(...) do { if (log_enabled(LL_ERROR)) log_write(LL_ERROR, __VA_ARGS__); } while (0)
+#define msg(...) do { if (log_enabled(LL_INFO)) log_write(LL_INFO, __VA_ARGS__); } while (0)
+#define dbg(...) do { if (log_enabled(LL_DEBUG)) log_write(LL_DEBUG, __VA_ARGS__); } while (0)
+
+// How many different messages of one interface are limited separately
+#define LOG_LIMIT_KINDS 4
+
+/*
+ * Limit of messages of one interface, so a misbehaving modem doesn't flood the
+ * log. Each message (told by its format) has its own limit, so a repeating one
+ * doesn't hide the others.
+ */
+struct log_limit {
+	struct log_limit_kind {
+		const char *message;
+		uint64_t window_start;
+		unsigned count;
+		unsigned suppressed;
+	} kinds[LOG_LIMIT_KINDS];
+};
+
+// Log a message about an interface, prefixed by its name, unless it is over the limit
+void log_line(struct log_limit *limit, uint64_t now, const char *ifname, enum log_level level, const char *message, ...) __attribute__((format(printf, 5, 6)));
+
+// Log a message about an interface (something with ifname, now and log_limit, usually struct line)
+#define line_msg(line, ...) do { if (log_enabled(LL_INFO)) log_line(&(line)->log_limit, (line)->now, (line)->ifname, LL_INFO, __VA_ARGS__); } while (0)
+#define line_error(line, ...) do { if (log_enabled(LL_ERROR)) log_line(&(line)->log_limit, (line)->now, (line)->ifname, LL_ERROR, __VA_ARGS__); } while (0)
+
+/*
+ * The messages for syslog are queued and sent from the main loop by
+ * log_flush, so a slow syslog daemon doesn't block the daemon. Without
+ * log_init, nothing goes to the syslog (the tools sharing this module log
+ * to stderr only).
+ */
+void log_init(const char *ident);
+/*
+ * How soon to try again sending the messages to the syslog if it is busy,
+ * or connecting to it if it is not there (ms).
+ */
+#define LOG_RETRY 100
+// Send the queued messages. The now is in milliseconds, to limit the attempts to connect.
+void log_flush(uint64_t now);
+// Are there messages the syslog didn't take yet?
+bool log_pending(void);
 
 #endif
@@ -0,0 +1,178 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "watchdog.h"
+#include "configuration.h"
+#include "proto_const.h"
+#include "util.h"
+
+#include <string.h>
+
+// The states of the line, as reported by the modem
+enum line_state {
+	LS_IDLE,
+	LS_HANDSHAKE,
+	LS_TRAINING,
+	LS_ONLINE = STATE_OK,
+	LS_NO_SIGNAL,
+	LS_CRC_ERROR,
+	LS_DISABLED
+};
+
+// How long do we tolerate each kind of trouble before resetting (ms)
+#define RETRAIN_GRACE (3 * 60 * 1000)
+#define DOWN_GRACE (60 * 1000)
+// Training with the very same non-zero values for this long means the modem froze
+#define FROZEN_GRACE (60 * 1000)
+// How many consecutive samples are needed to consider the line silent or stuck
+#define SILENT_LIMIT 2
+#define STUCK_LIMIT 2
+// How long must a line stay silent or stuck after a reset that didn't help (ms)
+#define SILENT_GRACE (15 * 1000)
+#define STUCK_GRACE (15 * 1000)
+// Cap on the grace multiplier after repeated resets (1 << this)
+#define MAX_BACKOFF_SHIFT 4
+
+enum sample_class {
+	SC_OK,
+	SC_TRAINING,
+	SC_DOWN,
+	SC_STUCK,
+	SC_SILENT
+};
+
+void watchdog_init(struct watchdog *watchdog) {
+	memset(watchdog, 0, sizeof *watchdog);
+}
+
+static enum sample_class classify(const struct watchdog_sample *sample) {
+	if (!sample->answered)
+		return SC_SILENT;
+	switch (sample->state) {
+		case LS_ONLINE:
+			// Online, but nothing gets through. That doesn't get better by waiting.
+			if (!sample->dscur || !sample->uscur)
+				return SC_STUCK;
+			return SC_OK;
+		case LS_HANDSHAKE:
+		case LS_TRAINING:
+			return SC_TRAINING;
+		default:
+			return SC_DOWN;
+	}
+}
+
+// Get the sample n steps into the history (0 is the latest one)
+static const struct watchdog_sample *past(const struct watchdog *watchdog, size_t n) {
+	return &watchdog->history[(watchdog->pos + WATCHDOG_HISTORY - 1 - n) % WATCHDOG_HISTORY];
+}
+
+// How many of the latest samples are of the given class, in a row
+static size_t streak(const struct watchdog *watchdog, enum sample_class class) {
+	size_t result = 0;
+	while (result < watchdog->count && classify(past(watchdog, result)) == class)
+		result ++;
+	return result;
+}
+
+static bool same_snapshot(const struct watchdog_sample *a, const struct watchdog_sample *b) {
+	return a->answered == b->answered && a->state == b->state && a->power == b->power && a->dscur == b->dscur && a->uscur == b->uscur && a->dspower == b->dspower && a->uspower == b->uspower;
+}
+
+/*
+ * A training line changes its power levels and rates as it goes. If the modem
+ * reports the very same snapshot for a long time, it is frozen and no amount of
+ * waiting helps. Before the training gets anywhere (during handshake, or at
+ * its start), the snapshot is all zeroes and stays the same legitimately.
+ */
+static bool frozen(const struct watchdog *watchdog, const struct watchdog_sample *sample, unsigned shift) {
+	if (sample->state != LS_TRAINING)
+		return false;
+	if (!sample->dscur && !sample->uscur && !sample->dspower && !sample->uspower)
+		return false;
+	return sample->time - watchdog->snapshot_since >= ((uint64_t)FROZEN_GRACE << shift);
+}
+
+/*
+ * The trouble repeated in enough samples in a row. The first time, that is
+ * enough. If the resets didn't help, it must also last for the grace, doubling
+ * with each reset.
+ */
+static bool persists(const struct watchdog *watchdog, const struct watchdog_sample *sample, enum sample_class class, size_t limit, uint64_t grace, unsigned shift) {
+	if (streak(watchdog, class) < limit)
+		return false;
+	return !shift || sample->time - watchdog->streak_since >= (grace << (shift - 1));
+}
+
+static enum watchdog_verdict reset(struct watchdog *watchdog, const char *reason) {
+	watchdog->reason = reason;
+	watchdog->resets ++;
+	watchdog->trouble_since = 0;
+	watchdog->count = 0;
+	return WD_RESET;
+}
+
+enum watchdog_verdict watchdog_sample(struct watchdog *watchdog, const struct watchdog_sample *sample) {
+	enum sample_class class = classify(sample);
+	if (!watchdog->count || classify(past(watchdog, 0)) != class)
+		watchdog->streak_since = sample->time;
+	if (!watchdog->count || !same_snapshot(past(watchdog, 0), sample))
+		watchdog->snapshot_since = sample->time;
+	watchdog->history[watchdog->pos] = *sample;
+	watchdog->pos = (watchdog->pos + 1) % WATCHDOG_HISTORY;
+	if (watchdog->count < WATCHDOG_HISTORY)
+		watchdog->count ++;
+	if (class == SC_OK) {
+		watchdog->trouble_since = 0;
+		watchdog->resets = 0;
+		return WD_HEALTHY;
+	}
+	if (!watchdog->trouble_since)
+		watchdog->trouble_since = sample->time;
+	// Don't reset the same line over and over in short succession if it didn't help the last time
+	unsigned shift = watchdog->resets < MAX_BACKOFF_SHIFT ? watchdog->resets : MAX_BACKOFF_SHIFT;
+	uint64_t trouble = sample->time - watchdog->trouble_since;
+	switch (class) {
+		case SC_SILENT:
+			if (persists(watchdog, sample, SC_SILENT, SILENT_LIMIT, SILENT_GRACE, shift))
+				return reset(watchdog, "Modem doesn't answer status queries");
+			break;
+		case SC_STUCK:
+			if (persists(watchdog, sample, SC_STUCK, STUCK_LIMIT, STUCK_GRACE, shift))
+				return reset(watchdog, "Modem claims to be online, but has no speed");
+			break;
+		case SC_TRAINING:
+			if (frozen(watchdog, sample, shift))
+				return reset(watchdog, "Modem is stuck in training");
+			if (trouble >= ((uint64_t)RETRAIN_GRACE << shift))
+				return reset(watchdog, "Modem is retraining for too long");
+			break;
+		case SC_DOWN:
+			if (trouble >= ((uint64_t)DOWN_GRACE << shift))
+				return reset(watchdog, "Line is down for too long");
+			break;
+		case SC_OK: // Handled above already
+			break;
+	}
+	dbg("Line not healthy for %llu ms, waiting\n", (unsigned long long)trouble);
+	return WD_WAIT;
+}
+
+int watchdog_next(const struct watchdog *watchdog) {
+	return watchdog->trouble_since ? WATCHDOG_FAST_INTERVAL : watch_interval;
+}
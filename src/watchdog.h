@@ -0,0 +1,71 @@
+/*
+ * SMRTd ‒ daemon to initialize the Small Modem for Router Turris
+ * Copyright (C) 2014 CZ.NIC, z.s.p.o. <http://www.nic.cz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMRT_WATCHDOG_H
+#define SMRT_WATCHDOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// How many last samples we keep for each line
+#define WATCHDOG_HISTORY 16
+// How often we look at a line that is not healthy (ms)
+#define WATCHDOG_FAST_INTERVAL 1000
+
+// One answer to the status query (or the lack of it)
+struct watchdog_sample {
+	uint64_t time;
+	bool answered;
+	uint8_t state;
+	uint8_t power;
+	uint32_t dscur, uscur;
+	uint16_t dspower, uspower;
+};
+
+struct watchdog {
+	struct watchdog_sample history[WATCHDOG_HISTORY];
+	size_t pos, count;
+	// When the line stopped being healthy. 0 if it is healthy.
+	uint64_t trouble_since;
+	// When the latest kind of trouble started (the first sample in the streak)
+	uint64_t streak_since;
+	// Since when the modem reports the very same values
+	uint64_t snapshot_since;
+	// Number of resets issued by the watchdog without the line getting healthy in between
+	unsigned resets;
+	// Why the last reset was issued
+	const char *reason;
+};
+
+enum watchdog_verdict {
+	// Everything is fine, check again after the configured interval
+	WD_HEALTHY,
+	// Something is not right, but it may get better on its own (eg. retraining). Watch closely.
+	WD_WAIT,
+	// It is not going to get better, reset the modem
+	WD_RESET
+};
+
+void watchdog_init(struct watchdog *watchdog);
+// Store another sample and decide what to do with the line
+enum watchdog_verdict watchdog_sample(struct watchdog *watchdog, const struct watchdog_sample *sample);
+// Number of milliseconds until the line should be checked again
+int watchdog_next(const struct watchdog *watchdog);
+
+#endif